@@ -25,6 +25,15 @@ int64_t base::now_tick()
 	gettimeofday(&le,0);
 	return ((int64_t)le.tv_sec*1000+le.tv_usec/1000)-((int64_t)ls.tv_sec*1000+ls.tv_usec/1000);
 }
+
+int64_t base::now_usec()
+{
+	if(!time_initialized)
+		init_time();
+	timeval le;
+	gettimeofday(&le,0);
+	return ((int64_t)le.tv_sec*1000000+le.tv_usec)-((int64_t)ls.tv_sec*1000000+ls.tv_usec);
+}
 #else
 namespace
 {
@@ -46,6 +55,15 @@ int64_t base::now_tick()
 	QueryPerformanceCounter(&le);
 	return (int64_t)((double(le.QuadPart-ls.QuadPart))/double(l.QuadPart)*1000);
 }
+
+int64_t base::now_usec()
+{
+	if(!time_initialized)
+		init_time();
+	LARGE_INTEGER le;
+	QueryPerformanceCounter(&le);
+	return (int64_t)((double(le.QuadPart-ls.QuadPart))/double(l.QuadPart)*1000000);
+}
 #endif
 
 void base::sleep(int millisec)
@@ -57,6 +75,25 @@ void base::sleep(int millisec)
 #endif
 }
 
+int64_t base::thread_cpu_usec()
+{
+#ifdef __linux__
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+	return (int64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+	FILETIME create,exit,kernel,user;
+	if(!GetThreadTimes(GetCurrentThread(),&create,&exit,&kernel,&user))
+		return 0;
+	ULARGE_INTEGER k,u;
+	k.LowPart=kernel.dwLowDateTime;
+	k.HighPart=kernel.dwHighDateTime;
+	u.LowPart=user.dwLowDateTime;
+	u.HighPart=user.dwHighDateTime;
+	return (int64_t)((k.QuadPart+u.QuadPart)/10);
+#endif
+}
+
 void base::format_time(std::time_t t,std::string& str)
 {
 	tm* timeinfo=NULL;
@@ -9,6 +9,9 @@ namespace base
 {
 	void sleep(int millisec);
 	int64_t now_tick();
+	int64_t now_usec();
+	// cpu time the calling thread has used,user plus kernel
+	int64_t thread_cpu_usec();
 	void format_time(std::time_t t,std::string& str);	
 }
 #endif
\ No newline at end of file
@@ -44,7 +44,7 @@ void base::Timer::add_timer_task(TimerTask* task)
 	assert(task->fired_time_>=0);
 	assert(task->id_>0);
 	min_heap_.push(task);
-	timer_map_[id]=task;
+	timer_map_[task->id_]=task;
 }
 
 void base::Timer::del_timer_task(uint64_t id)
@@ -3,31 +3,189 @@
 #include "../base/thread.h"
 #include "signal.h"
 #include "readerwriterqueue.h"
+#include <atomic>
+#include <vector>
+#include <queue>
+#include <functional>
 
 namespace base{
+  // small dense ids for producer threads,the lowest free one is handed out and a
+  // thread gives its id back when it exits,so short-lived threads don't use up the lanes.
+  // the lock orders the old owner's last enqueue before the new owner's first
+  class NotifyProducerIds
+  {
+  public:
+    static NotifyProducerIds& instance()
+    {
+      static NotifyProducerIds ids;
+      return ids;
+    }
+    int acquire()
+    {
+      Locker lock(&mutex_);
+      if(free_.empty())
+        return next_++;
+      int id=free_.top();
+      free_.pop();
+      return id;
+    }
+    void release(int id)
+    {
+      Locker lock(&mutex_);
+      free_.push(id);
+    }
+  private:
+    NotifyProducerIds():next_(0){}
+    int next_;
+    std::priority_queue<int,std::vector<int>,std::greater<int> > free_;
+    Mutex mutex_;
+  };
+
+  struct NotifyProducerId
+  {
+    NotifyProducerId():id_(NotifyProducerIds::instance().acquire()){}
+    ~NotifyProducerId(){NotifyProducerIds::instance().release(id_);}
+    int id_;
+  };
+
+  // indexes the per-producer lanes
+  inline int notify_producer_id()
+  {
+    static thread_local NotifyProducerId id;
+    return id.id_;
+  }
+
+  // multi producer single consumer queue,every producer thread owns a lock-free
+  // spsc lane,producers past MAX_LANES share a locked overflow lane.
+  // the signaler is only written when the consumer announced it is going to sleep:
+  //   consumer:if(q.prepare_wait()) block on get_fd(); q.finish_wait();
+  //   readable get_fd():q.consume_signal(),then drain with recv()
   template<typename T>
   class NotifyQueue
   {
   public:
+    enum {MAX_LANES=64};
+    NotifyQueue():nlanes_(0),waiting_(0),cursor_(0)
+    {
+      for(int i=0;i<MAX_LANES;++i)
+        lanes_[i].store(nullptr,std::memory_order_relaxed);
+    }
+    ~NotifyQueue()
+    {
+      for(int i=0;i<MAX_LANES;++i)
+        delete lanes_[i].load(std::memory_order_relaxed);
+    }
     fd_t get_fd(){return notify_.getfd();}
     void send(const T& t)
     {
-      mutex_.lock();
-      pipe_.enqueue(t);
-      notify_.send();
-      mutex_.unlock();
+      int id=notify_producer_id();
+      if(id<MAX_LANES)
+        get_lane(id)->enqueue(t);
+      else
+      {
+        mutex_.lock();
+        overflow_.enqueue(t);
+        mutex_.unlock();
+      }
+      wakeup();
     }
+    // enqueue n items with a single wakeup
+    void send(const T* t,int n)
+    {
+      int id=notify_producer_id();
+      if(id<MAX_LANES)
+      {
+        pipe_t* lane=get_lane(id);
+        for(int i=0;i<n;++i)
+          lane->enqueue(t[i]);
+      }
+      else
+      {
+        mutex_.lock();
+        for(int i=0;i<n;++i)
+          overflow_.enqueue(t[i]);
+        mutex_.unlock();
+      }
+      wakeup();
+    }
+    // consumer only,lanes are visited round robin so one busy producer can't starve the others
     bool recv(T& t)
+    {
+      int n=nlanes_.load(std::memory_order_acquire);
+      for(int i=0;i<n;++i)
+      {
+        int idx=(cursor_+i)%n;
+        pipe_t* lane=lanes_[idx].load(std::memory_order_acquire);
+        if(lane&&lane->try_dequeue(t))
+        {
+          cursor_=(idx+1)%n;
+          return true;
+        }
+      }
+      return overflow_.try_dequeue(t);
+    }
+    bool empty()
+    {
+      int n=nlanes_.load(std::memory_order_acquire);
+      for(int i=0;i<n;++i)
+      {
+        pipe_t* lane=lanes_[i].load(std::memory_order_acquire);
+        if(lane&&lane->peek())
+          return false;
+      }
+      return overflow_.peek()==nullptr;
+    }
+    // announce the consumer is about to block,false if items are pending and it must not
+    bool prepare_wait()
+    {
+      waiting_.store(1,std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(!empty())
+      {
+        waiting_.store(0,std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+    void finish_wait()
+    {
+      waiting_.store(0,std::memory_order_relaxed);
+    }
+    // drain the signaler after get_fd() turned readable
+    void consume_signal()
     {
       notify_.recv();
-      return pipe_.try_dequeue(t);
     }
   private:
     typedef moodycamel::ReaderWriterQueue<T> pipe_t;
-    pipe_t pipe_;
-    Signaler notify_;
-    base::Mutex mutex_;
+    pipe_t* get_lane(int id)
+    {
+      pipe_t* lane=lanes_[id].load(std::memory_order_acquire);
+      if(lane)
+        return lane;
+      lane=new pipe_t;
+      lanes_[id].store(lane,std::memory_order_release);
+      int n=nlanes_.load(std::memory_order_relaxed);
+      while(n<=id&&!nlanes_.compare_exchange_weak(n,id+1,std::memory_order_acq_rel))
+        ;
+      return lane;
+    }
+    void wakeup()
+    {
+      // pairs with the store/load in prepare_wait,either we see waiting_ or it sees our item
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(waiting_.load(std::memory_order_relaxed)&&waiting_.exchange(0)==1)
+        notify_.send();
+    }
+  private:
+    std::atomic<pipe_t*> lanes_[MAX_LANES];
+    std::atomic<int>     nlanes_;
+    std::atomic<int>     waiting_;
+    int                  cursor_;
+    pipe_t               overflow_;
+    Signaler             notify_;
+    base::Mutex          mutex_;
   };
-} 
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -1,4 +1,10 @@
 #include "thread.h"
+#ifdef __linux__
+#include <sched.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
  
 namespace base
 {
@@ -62,6 +68,73 @@ namespace base
 		}
 	}
 
+  bool Threads::bind_current_thread(int cpu)
+  {
+    if(cpu<0)
+      return false;
+#ifdef _WIN32
+    if(cpu>=(int)sizeof(DWORD_PTR)*8)
+      return false;
+    return SetThreadAffinityMask(GetCurrentThread(),(DWORD_PTR)1<<cpu)!=0;
+#else
+    if(cpu>=CPU_SETSIZE)
+      return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    if(pthread_setaffinity_np(pthread_self(),sizeof(set),&set)!=0)
+      return false;
+#ifdef SYS_set_mempolicy
+    // MPOL_LOCAL,also when the process was started with an interleave policy
+    const int ezMpolLocal=4;
+    syscall(SYS_set_mempolicy,ezMpolLocal,nullptr,0);
+#endif
+    return true;
+#endif
+  }
+
+  int Threads::cpu_count()
+  {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n=sysconf(_SC_NPROCESSORS_CONF);
+    return n>0?(int)n:1;
+#endif
+  }
+
+  int Threads::cpu_node(int cpu)
+  {
+#ifdef _WIN32
+    UCHAR node=0;
+    if(cpu<0||cpu>255||!GetNumaProcessorNode((UCHAR)cpu,&node)||node==0xff)
+      return -1;
+    return node;
+#else
+    if(cpu<0)
+      return -1;
+    // the cpu directory links the node it belongs to
+    char path[128];
+    snprintf(path,sizeof(path),"/sys/devices/system/cpu/cpu%d",cpu);
+    DIR* dir=opendir(path);
+    if(!dir)
+      return -1;
+    int node=-1;
+    struct dirent* ent;
+    while(node<0&&(ent=readdir(dir))!=nullptr)
+    {
+      int n=0;
+      char tail=0;
+      if(sscanf(ent->d_name,"node%d%c",&n,&tail)==1)
+        node=n;
+    }
+    closedir(dir);
+    return node;
+#endif
+  }
+
 	unsigned long Threads::get_tick()
 	{
 #ifdef _WIN32
@@ -81,6 +154,8 @@ namespace base
   {
 #endif	
     Threads *thread = (Threads *)data;
+    if(thread->get_cpu()>=0)
+      Threads::bind_current_thread(thread->get_cpu());
     thread->run();
     return 0;
   }
@@ -104,6 +179,7 @@ namespace base
   Threads::Threads()
   {
     exit_=false;
+    cpu_=-1;
   }
 
   Threads::~Threads()
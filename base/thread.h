@@ -295,12 +295,23 @@ namespace base
 		virtual void  start();
     virtual void  run(){}
 		void          set_current_priority(ThreadPriority priority);
+    // core the thread binds itself to when it starts,-1 unbound(default).call before start()
+    void          set_cpu(int cpu) {cpu_=cpu;}
+    int           get_cpu() {return cpu_;}
+    // bind the calling thread to cpu and have it allocate from its numa node,
+    // so the memory it touches first ends up local
+    static bool   bind_current_thread(int cpu);
+    // configured cpus,online or not
+    static int    cpu_count();
+    // numa node of cpu,-1 if unknown
+    static int    cpu_node(int cpu);
 		unsigned long get_tick();
 		virtual void  stop();
     virtual void  join();
   protected:
     bool      exit_;
     pthread_t thread_;
+    int       cpu_;
   private:
     int get_platform_priority(ThreadPriority& priority);
     unsigned long start_tick_;
@@ -0,0 +1,139 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../base/notifyqueue.h"
+
+#include <poll.h>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+// the previous NotifyQueue(mutex + spsc queue + a signal per send),kept here as the baseline
+namespace locked
+{
+  template<typename T>
+  class NotifyQueue
+  {
+  public:
+    fd_t get_fd(){return notify_.getfd();}
+    void send(const T& t)
+    {
+      mutex_.lock();
+      pipe_.enqueue(t);
+      notify_.send();
+      mutex_.unlock();
+    }
+    bool recv(T& t)
+    {
+      notify_.recv();
+      return pipe_.try_dequeue(t);
+    }
+  private:
+    moodycamel::ReaderWriterQueue<T> pipe_;
+    base::Signaler notify_;
+    base::Mutex mutex_;
+  };
+}
+
+struct Item
+{
+  int     producer_;
+  int64_t seq_;
+};
+
+template<typename QUEUE>
+class Producer:public base::Threads
+{
+public:
+  Producer(QUEUE* q,int id,int64_t n):q_(q),id_(id),n_(n){}
+  virtual void run()
+  {
+    for(int64_t i=0;i<n_;++i)
+    {
+      Item item={id_,i};
+      q_->send(item);
+    }
+  }
+private:
+  QUEUE*  q_;
+  int     id_;
+  int64_t n_;
+};
+
+static bool wait_readable(fd_t fd)
+{
+  struct pollfd pfd={fd,POLLIN,0};
+  return ::poll(&pfd,1,100)>0;
+}
+
+// old consumer:every recv reads the signaler,block when the queue looks empty
+static void consume(locked::NotifyQueue<Item>* q,int64_t total,long& wakeups)
+{
+  Item item;
+  for(int64_t got=0;got<total;)
+  {
+    if(q->recv(item))
+      ++got;
+    else if(wait_readable(q->get_fd()))
+      ++wakeups;
+  }
+}
+
+// new consumer:drain,then only block after announcing it
+static void consume(base::NotifyQueue<Item>* q,int64_t total,long& wakeups)
+{
+  Item item;
+  for(int64_t got=0;got<total;)
+  {
+    while(q->recv(item))
+      ++got;
+    if(got>=total)
+      break;
+    if(q->prepare_wait())
+    {
+      if(wait_readable(q->get_fd()))
+      {
+        q->consume_signal();
+        ++wakeups;
+      }
+    }
+    q->finish_wait();
+  }
+}
+
+template<typename QUEUE>
+void run(const char* name,int producers,int64_t perproducer)
+{
+  QUEUE* q=new QUEUE;
+  std::vector<Producer<QUEUE>*> threads;
+  for(int i=0;i<producers;++i)
+    threads.push_back(new Producer<QUEUE>(q,i,perproducer));
+  long wakeups=0;
+  int64_t t0=base::now_usec();
+  for(int i=0;i<producers;++i)
+    threads[i]->start();
+  consume(q,producers*perproducer,wakeups);
+  int64_t t1=base::now_usec();
+  for(int i=0;i<producers;++i)
+  {
+    threads[i]->join();
+    delete threads[i];
+  }
+  int64_t total=producers*perproducer;
+  printf("%-8s producers=%-3d msgs=%-9lld %7.1fns/msg %8.2fMmsg/s wakeups=%ld\n",
+    name,producers,(long long)total,(t1-t0)*1000.0/total,total/(double)(t1-t0),wakeups);
+  delete q;
+}
+
+int main(int argc,char** argv)
+{
+  int64_t total=argc>1?atoll(argv[1]):4000000;
+  int producers[]={1,4,16};
+  for(size_t i=0;i<sizeof(producers)/sizeof(producers[0]);++i)
+  {
+    int p=producers[i];
+    run<locked::NotifyQueue<Item> >("locked",p,total/p);
+    run<base::NotifyQueue<Item> >("lockfree",p,total/p);
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../net/poller.h"
+
+#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace net;
+
+// the previous PollTimer(binary heap + hash map),kept here as the baseline
+namespace heap
+{
+  struct PollTimerEntry
+  {
+    int64_t             fired_time_;
+    IPollerEventHander* hander_;
+    PollTimerEntry():fired_time_(0),hander_(NULL){}
+  };
+  struct PollCmp
+  {
+    bool operator()(const PollTimerEntry* a,const PollTimerEntry* b)
+    {
+      return a->fired_time_>b->fired_time_;
+    }
+  };
+  class PollTimer
+  {
+  public:
+    void add_timer(IPollerEventHander* hander,int64_t timeout)
+    {
+      if(map_.find(hander)!=map_.end())
+        return;
+      PollTimerEntry* entry=new PollTimerEntry;
+      entry->fired_time_=base::now_tick()+timeout;
+      entry->hander_=hander;
+      heap_.push(entry);
+      map_[hander]=entry;
+    }
+    void del_timer(IPollerEventHander* hander)
+    {
+      auto iter=map_.find(hander);
+      if(iter!=map_.end())
+        iter->second->hander_=NULL;
+    }
+    int64_t invoke_timer(int64_t cur)
+    {
+      while(!heap_.empty())
+      {
+        PollTimerEntry* entry=heap_.top();
+        if(entry->fired_time_>cur)
+          return entry->fired_time_-cur;
+        if(entry->hander_)
+          entry->hander_->handle_timer();
+        heap_.pop();
+        auto iter=map_.find(entry->hander_);
+        if(iter!=map_.end())
+          map_.erase(iter);
+      }
+      return -1;
+    }
+    size_t size() {return heap_.size();}
+  private:
+    std::priority_queue<PollTimerEntry*,std::vector<PollTimerEntry*>,PollCmp> heap_;
+    std::unordered_map<IPollerEventHander*,PollTimerEntry*> map_;
+  };
+}
+
+class BenchHander:public IPollerEventHander
+{
+public:
+  virtual void handle_in_event(){}
+  virtual void handle_out_event(){}
+  virtual void handle_timer(){++fired;}
+  static long fired;
+};
+long BenchHander::fired=0;
+
+template<typename TIMER>
+void run(const char* name,int n,const std::vector<int64_t>& timeouts)
+{
+  std::vector<BenchHander> handers(n);
+  TIMER* timer=new TIMER;
+  BenchHander::fired=0;
+
+  int64_t t0=base::now_usec();
+  for(int i=0;i<n;++i)
+    timer->add_timer(&handers[i],timeouts[i]);
+  int64_t t1=base::now_usec();
+  for(int i=0;i<n;i+=2)
+    timer->del_timer(&handers[i]);
+  int64_t t2=base::now_usec();
+  size_t pending=timer->size();
+  // walk the clock forward 1ms per tick,as a poller would
+  int64_t start=base::now_tick();
+  for(int64_t now=start;now<=start+61000;++now)
+    timer->invoke_timer(now);
+  int64_t t3=base::now_usec();
+
+  printf("%-6s n=%-7d add=%6.1fns/op del=%6.1fns/op expire=%8.1fms pending_after_del=%-7d fired=%ld\n",
+    name,n,(t1-t0)*1000.0/n,(t2-t1)*1000.0/(n/2),(t3-t2)/1000.0,(int)pending,BenchHander::fired);
+  delete timer;
+}
+
+int main(int argc,char** argv)
+{
+  int sizes[]={1000,10000,100000};
+  for(size_t s=0;s<sizeof(sizes)/sizeof(sizes[0]);++s)
+  {
+    int n=sizes[s];
+    std::vector<int64_t> timeouts(n);
+    srand(n);
+    for(int i=0;i<n;++i)
+      timeouts[i]=1+rand()%60000;
+    run<heap::PollTimer>("heap",n,timeouts);
+    run<net::PollTimer>("wheel",n,timeouts);
+  }
+  return 0;
+}
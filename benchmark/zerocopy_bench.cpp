@@ -0,0 +1,138 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../net/socket.h"
+
+#include <poll.h>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// loopback send throughput,plain send vs MSG_ZEROCOPY,per message size.
+// on loopback the kernel usually falls back to copying(copied=yes),run it
+// across a real nic to see where pinning pages starts to pay off
+using namespace net;
+
+class Receiver:public base::Threads
+{
+public:
+  explicit Receiver(SOCKET fd):fd_(fd){}
+  virtual void run()
+  {
+    std::vector<char> buf(1<<20);
+    while(Read(fd_,&buf[0],buf.size())>0)
+      ;
+  }
+private:
+  SOCKET fd_;
+};
+
+static bool connect_pair(int port,SOCKET& cli,SOCKET& srv)
+{
+  SOCKET listener=CreateTcpServer(port,nullptr);
+  if(listener==INVALID_SOCKET)
+    return false;
+  cli=::socket(AF_INET,SOCK_STREAM,0);
+  sockaddr_in addr;
+  FromIpPort("127.0.0.1",port,&addr);
+  if(Connect(cli,addr)!=0)
+  {
+    CloseSocket(listener);
+    return false;
+  }
+  struct pollfd pfd={listener,POLLIN,0};
+  ::poll(&pfd,1,1000);
+  srv=Accept(listener,nullptr);
+  CloseSocket(listener);
+  // blocking sender and receiver
+  int flags=fcntl(srv,F_GETFL,0);
+  fcntl(srv,F_SETFL,flags&~O_NONBLOCK);
+  return srv!=INVALID_SOCKET;
+}
+
+// reap completions,return how many sends are still outstanding
+static uint32_t reap(SOCKET fd,uint32_t sent,uint32_t& done,bool& copied)
+{
+  uint32_t lo=0,hi=0;
+  bool c=false;
+  while(ReadZeroCopyDone(fd,lo,hi,&c)>0)
+  {
+    done=hi+1;
+    copied=copied||c;
+  }
+  return sent-done;
+}
+
+static void run(int port,size_t size,int64_t total,bool zerocopy)
+{
+  SOCKET cli=INVALID_SOCKET,srv=INVALID_SOCKET;
+  if(!connect_pair(port,cli,srv))
+  {
+    printf("connect fail\n");
+    return;
+  }
+  if(zerocopy&&!EnableZeroCopy(cli))
+  {
+    printf("SO_ZEROCOPY not supported\n");
+    CloseSocket(cli);
+    CloseSocket(srv);
+    return;
+  }
+  Receiver recv(srv);
+  recv.start();
+  std::vector<char> payload(size,'z');
+  uint32_t sent=0,done=0;
+  bool copied=false;
+  int64_t bytes=0;
+  int64_t t0=base::now_usec();
+  while(bytes<total)
+  {
+    IoVec iov;
+    SetIoVec(iov,&payload[0],size);
+    int n=zerocopy?WritevZeroCopy(cli,&iov,1):Writev(cli,&iov,1);
+    if(n<0)
+    {
+      if(errno==ENOBUFS)
+      {
+        // too many pinned sends,wait for completions
+        struct pollfd pfd={cli,0,0};
+        ::poll(&pfd,1,10);
+        reap(cli,sent,done,copied);
+        continue;
+      }
+      break;
+    }
+    bytes+=n;
+    if(zerocopy)
+    {
+      ++sent;
+      reap(cli,sent,done,copied);
+    }
+  }
+  while(zerocopy&&reap(cli,sent,done,copied)>0)
+  {
+    struct pollfd pfd={cli,0,0};
+    ::poll(&pfd,1,10);
+  }
+  int64_t t1=base::now_usec();
+  ::shutdown(cli,SHUT_WR);
+  recv.join();
+  CloseSocket(cli);
+  CloseSocket(srv);
+  printf("%-8s size=%-8d %9.1fMB/s %7.2fus/send%s\n",zerocopy?"zerocopy":"copy",(int)size,
+    bytes/(double)(t1-t0),(t1-t0)/(double)(bytes/size),zerocopy?(copied?" copied=yes":" copied=no"):"");
+}
+
+int main(int argc,char** argv)
+{
+  int64_t total=(argc>1?atoll(argv[1]):256)<<20;
+  int port=30000+(getpid()%20000);
+  size_t sizes[]={1024,4096,16384,65536,262144,1048576};
+  for(size_t i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i)
+  {
+    run(port++,sizes[i],total,false);
+    run(port++,sizes[i],total,true);
+  }
+  return 0;
+}
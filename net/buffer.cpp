@@ -1,120 +1,391 @@
 #include <string.h>
 #include <cstdint>
+#include <cstdlib>
 #include <cassert>
 #include <cerrno>
 #include <cstddef>
+#include <new>
 #include "buffer.h"
 #include "socket.h"
+#include "netpack.h"
 
 /**
-*** ӦòĽջַʽԿǡ1ʹù̶Сٽգ
-***ʱʹepollˮƽʽʹñԵҪһԽݣ1ַʽôǣ
-***2:ʹù̶СĶУÿν8KڶУַʽǸЧʱԼڴ濽ǽṹӣ
-***Ȩһ費Ϊƿʲ÷ʽ1
+*** chained receive/send buffer:a list of fixed size blocks from the io thread pool,
+*** data is never moved to make room,only a frame straddling blocks is pulled up for the decoder
 **/
-net::Buffer::Buffer(size_t initSize/*=ezInitSize*/)
+static const int ezMaxIoVec=64;
+
+net::BufferPool::BufferPool(size_t blocksize/*=ezBlockSize*/,size_t maxfree/*=1024*/)
+	:blocksize_(blocksize)
+	,maxfree_(maxfree)
+	,minfree_(0)
+	,free_(nullptr)
+	,remote_(nullptr)
+	,nfree_(0)
+	,usedblocks_(0)
+	,usedbytes_(0)
+	,peakbytes_(0)
 {
-	orig_buffer_=new char[initSize];
-	buffer_=orig_buffer_;
-	totallen_=initSize;
-	misalign_=0;
-	off_=0;
 }
 
-net::Buffer::~Buffer()
+net::BufferPool::~BufferPool()
 {
-	if(orig_buffer_)
-		delete [] orig_buffer_;
+	collect_remote();
+	while(free_)
+	{
+		BufferBlock* block=free_;
+		free_=block->next_;
+		::free(block);
+	}
 }
 
-void net::Buffer::drain(size_t len)
+void net::BufferPool::account(int64_t blocks,int64_t bytes)
+{
+	// single writer,plain load/store keeps the counters off the locked bus
+	usedblocks_.store(usedblocks_.load(std::memory_order_relaxed)+blocks,std::memory_order_relaxed);
+	int64_t used=usedbytes_.load(std::memory_order_relaxed)+bytes;
+	usedbytes_.store(used,std::memory_order_relaxed);
+	if(used>peakbytes_.load(std::memory_order_relaxed))
+		peakbytes_.store(used,std::memory_order_relaxed);
+}
+
+net::BufferBlock* net::BufferPool::alloc(size_t size/*=0*/)
+{
+	BufferBlock* block=nullptr;
+	if(!free_)
+		collect_remote();
+	int64_t nfree=nfree_.load(std::memory_order_relaxed);
+	if(size<=blocksize_&&free_)
+	{
+		block=free_;
+		free_=block->next_;
+		nfree_.store(--nfree,std::memory_order_relaxed);
+		if((size_t)nfree<minfree_)
+			minfree_=(size_t)nfree;
+	}
+	else
+	{
+		size_t cap=size>blocksize_?size:blocksize_;
+		block=(BufferBlock*)::malloc(sizeof(BufferBlock)+cap);
+		block->cap_=cap;
+		block->base_=(char*)(block+1);
+		block->pool_=this;
+		block->ref_=false;
+		new(&block->refs_) std::atomic<int>(1);
+	}
+	account(1,(int64_t)block->cap_);
+	block->zc_=false;
+	block->next_=nullptr;
+	block->rpos_=0;
+	block->wpos_=0;
+	return block;
+}
+
+net::BufferBlock* net::BufferPool::alloc_ref(Msg* msg)
 {
-	size_t oldoff=off_;
-	if(len>=off_)
+	BufferBlock* block=(BufferBlock*)::malloc(sizeof(BufferBlock)+sizeof(Msg));
+	Msg* held=(Msg*)(block+1);
+	msg_init(held);
+	msg_move(msg,held);
+	block->next_=nullptr;
+	block->cap_=msg_size(held);
+	block->rpos_=0;
+	block->wpos_=block->cap_;
+	block->base_=(char*)msg_data(held);
+	block->pool_=this;
+	new(&block->refs_) std::atomic<int>(1);
+	block->ref_=true;
+	block->zc_=false;
+	block->zcid_=0;
+	return block;
+}
+
+void net::BufferPool::release(BufferBlock* block)
+{
+	if(block->ref_)
 	{
-		off_=0;
-		buffer_=orig_buffer_;
-		misalign_=0;
+		msg_free((Msg*)(block+1));
+		::free(block);
 		return;
 	}
-	buffer_+=len;
-	misalign_+=len;
+	// slices are only carved on this thread,refs_==1 means nobody else can hold the block
+	if(block->refs_.load(std::memory_order_acquire)!=1&&block->refs_.fetch_sub(1,std::memory_order_acq_rel)!=1)
+		return;
+	recycle(block);
+}
 
-	off_-=len;
+void net::BufferPool::release_slice(BufferBlock* block)
+{
+	if(block->refs_.fetch_sub(1,std::memory_order_acq_rel)!=1)
+		return;
+	// last reference,hand the block back to the owner thread
+	BufferPool* pool=block->pool_;
+	BufferBlock* head=pool->remote_.load(std::memory_order_relaxed);
+	do
+	{
+		block->next_=head;
+	}while(!pool->remote_.compare_exchange_weak(head,block,std::memory_order_release,std::memory_order_relaxed));
 }
 
-int net::Buffer::remove(void* data,size_t datlen)
+void net::BufferPool::collect_remote()
+{
+	if(!remote_.load(std::memory_order_relaxed))
+		return;
+	BufferBlock* block=remote_.exchange(nullptr,std::memory_order_acquire);
+	while(block)
+	{
+		BufferBlock* next=block->next_;
+		recycle(block);
+		block=next;
+	}
+}
+
+void net::BufferPool::recycle(BufferBlock* block)
+{
+	account(-1,-(int64_t)block->cap_);
+	block->refs_.store(1,std::memory_order_relaxed);
+	int64_t nfree=nfree_.load(std::memory_order_relaxed);
+	if(block->cap_!=blocksize_||(size_t)nfree>=maxfree_)
+	{
+		::free(block);
+		return;
+	}
+	block->next_=free_;
+	free_=block;
+	nfree_.store(nfree+1,std::memory_order_relaxed);
+}
+
+void net::BufferPool::trim()
 {
-	size_t nread=datlen;
-	if (nread>=off_)
-		nread=off_;
-	memcpy(data,buffer_,nread);
-	drain(nread);
-	return (nread);
+	collect_remote();
+	size_t n=minfree_;
+	int64_t nfree=nfree_.load(std::memory_order_relaxed);
+	while(n-->0&&free_)
+	{
+		BufferBlock* block=free_;
+		free_=block->next_;
+		--nfree;
+		::free(block);
+	}
+	nfree_.store(nfree,std::memory_order_relaxed);
+	minfree_=(size_t)nfree;
 }
 
-void net::Buffer::align()
+net::Buffer::Buffer(BufferPool* pool,size_t limit)
+	:pool_(pool)
+	,head_(nullptr)
+	,tail_(nullptr)
+	,off_(0)
+	,limit_(limit)
+	,zchead_(nullptr)
+	,zctail_(nullptr)
+	,zcseq_(0)
+	,zcdone_((uint32_t)-1)
+	,zcbytes_(0)
 {
-	memmove(orig_buffer_,buffer_,off_);
-	buffer_=orig_buffer_;
-	misalign_=0;
 }
 
-int net::Buffer::maxadd()
+net::Buffer::~Buffer()
 {
-	return (totallen_-off_);
+	while(head_)
+	{
+		BufferBlock* block=head_;
+		head_=block->next_;
+		pool_->release(block);
+	}
+	// only reached with blocks pending when their completions are given up,
+	// see abandon_zerocopy
+	while(zchead_)
+	{
+		BufferBlock* block=zchead_;
+		zchead_=block->next_;
+		pool_->release(block);
+	}
 }
 
-int net::Buffer::fastadd()
+net::BufferBlock* net::Buffer::append_block()
 {
-	return (totallen_-off_-misalign_);
+	BufferBlock* block=pool_->alloc();
+	if(tail_)
+		tail_->next_=block;
+	else
+		head_=block;
+	tail_=block;
+	return block;
 }
 
-int net::Buffer::expand(size_t datlen)
+void net::Buffer::drain(size_t len)
 {
-	size_t space=totallen_-misalign_-off_;
-	if(space>=datlen)
-		return 0;
-	else if(totallen_-off_>datlen)
+	while(len>0&&head_)
 	{
-		align();
-		return 0;
+		size_t n=head_->readable();
+		if(n>len)
+			n=len;
+		head_->rpos_+=n;
+		off_-=n;
+		len-=n;
+		if(head_->readable()>0)
+			break;
+		BufferBlock* block=head_;
+		head_=block->next_;
+		if(!head_)
+			tail_=nullptr;
+		retire(block);
+	}
+}
+
+// a drained block goes back to the pool,one tcp may still read from waits for its completion.
+// the completion may have come while the rest of the block was still queued,e.g. copied
+// after ENOBUFS
+void net::Buffer::retire(BufferBlock* block)
+{
+	if(!block->zc_||(int32_t)(block->zcid_-zcdone_)<=0)
+	{
+		pool_->release(block);
+		return;
 	}
+	block->next_=nullptr;
+	if(zctail_)
+		zctail_->next_=block;
 	else
-		return -1;
+		zchead_=block;
+	zctail_=block;
+	zcbytes_+=block->cap_;
+}
+
+int net::Buffer::remove(void* data,size_t datlen)
+{
+	size_t nread=0;
+	while(nread<datlen&&head_&&head_->readable()>0)
+	{
+		size_t n=head_->readable();
+		if(n>datlen-nread)
+			n=datlen-nread;
+		memcpy((char*)data+nread,head_->data()+head_->rpos_,n);
+		nread+=n;
+		drain(n);
+	}
+	return (int)nread;
+}
+
+int net::Buffer::fastadd()
+{
+	return (int)limit_-(int)off_;
 }
 
 int net::Buffer::add(const void* data,size_t datlen)
 {
-	if(expand(datlen)<0)
-		return -1;
-	memcpy(buffer_+off_,data,datlen);
-	off_+=datlen;
+	const char* p=(const char*)data;
+	while(datlen>0)
+	{
+		BufferBlock* block=tail_;
+		if(!block||block->writable()==0)
+			block=append_block();
+		size_t n=block->writable();
+		if(n>datlen)
+			n=datlen;
+		memcpy(block->data()+block->wpos_,p,n);
+		block->wpos_+=n;
+		off_+=n;
+		p+=n;
+		datlen-=n;
+	}
 	return 0;
 }
 
+void net::Buffer::add_ref(Msg* msg)
+{
+	BufferBlock* block=pool_->alloc_ref(msg);
+	if(tail_)
+		tail_->next_=block;
+	else
+		head_=block;
+	tail_=block;
+	off_+=block->readable();
+}
+
+static void free_slice(void* data,void* hint)
+{
+	net::BufferPool::release_slice((net::BufferBlock*)hint);
+}
+
+void net::Buffer::slice(Msg* msg,char* data,int size)
+{
+	assert(head_&&data>=head_->data()+head_->rpos_&&data+size<=head_->data()+head_->wpos_);
+	head_->refs_.fetch_add(1,std::memory_order_relaxed);
+	msg_init_data(msg,(int8_t*)data,size,&free_slice,head_);
+}
+
 int net::Buffer::readfd(int fd)
 {
-	int canread=fastadd();
-	if(canread<=0)
+	// an empty buffer borrows a block for the read and gives it back if nothing came in
+	bool borrowed=false;
+	if(!tail_)
+	{
+		append_block();
+		borrowed=true;
+	}
+	IoVec iov[2];
+	int cnt=0;
+	size_t space=tail_->writable();
+	if(space>0)
+		SetIoVec(iov[cnt++],tail_->data()+tail_->wpos_,space);
+	// a spare block only when the tail is nearly full,the caller reads again for the rest
+	BufferBlock* spare=nullptr;
+	if(space<pool_->block_size()/4)
 	{
-		align();
-		canread=fastadd();
-		if(canread<=0)
-			return 0x7fffffff;
+		spare=pool_->alloc();
+		SetIoVec(iov[cnt++],spare->data(),spare->cap_);
 	}
-	char* p=buffer_+off_;
-	int retn=Read(fd,p,canread);
+	int retn=Readv(fd,iov,cnt);
 	if(retn>0)
-		off_+=retn;
+	{
+		size_t n=(size_t)retn;
+		size_t intail=n<space?n:space;
+		tail_->wpos_+=intail;
+		off_+=n;
+		if(n>intail)
+		{
+			spare->wpos_=n-intail;
+			tail_->next_=spare;
+			tail_=spare;
+			spare=nullptr;
+		}
+	}
+	if(spare)
+		pool_->release(spare);
+	if(borrowed&&off_==0)
+	{
+		pool_->release(tail_);
+		head_=tail_=nullptr;
+	}
 	return retn;
 }
 
-int net::Buffer::writefd(int fd)
+int net::Buffer::writefd(int fd,size_t zcsize/*=0*/)
 {
 	while(off_>0)
 	{
-		int retn=Write(fd,buffer_,off_);
+		// the rest of a payload partly sent with MSG_ZEROCOPY takes the same path,its block
+		// has to wait for the completion whatever size is left
+		if(head_->zc_||(zcsize>0&&head_->ref_&&head_->readable()>=zcsize))
+		{
+			int rc=write_zerocopy(fd);
+			if(rc!=0)
+				return rc;
+			continue;
+		}
+		IoVec iov[ezMaxIoVec];
+		int cnt=0;
+		for(BufferBlock* block=head_;block&&cnt<ezMaxIoVec;block=block->next_)
+		{
+			// a zerocopy payload goes out in a send of its own
+			if(zcsize>0&&block->ref_&&block->readable()>=zcsize)
+				break;
+			if(block->readable()>0)
+				SetIoVec(iov[cnt++],block->data()+block->rpos_,block->readable());
+		}
+		int retn=Writev(fd,iov,cnt);
 		if(retn<0)
 		{
 			if(errno==EWOULDBLOCK||errno==EAGAIN)
@@ -127,8 +398,141 @@ int net::Buffer::writefd(int fd)
 	return 0;
 }
 
+int net::Buffer::peek(IoVec* iov,int cnt)
+{
+	int n=0;
+	for(BufferBlock* block=head_;block&&n<cnt;block=block->next_)
+	{
+		if(block->readable()>0)
+			SetIoVec(iov[n++],block->data()+block->rpos_,block->readable());
+	}
+	return n;
+}
+
+int net::Buffer::write_zerocopy(int fd)
+{
+	IoVec iov;
+	SetIoVec(iov,head_->data()+head_->rpos_,head_->readable());
+	int retn=WritevZeroCopy(fd,&iov,1);
+	if(retn<0&&errno==ENOBUFS)
+	{
+		// out of optmem for pinned pages,copy this chunk
+		retn=Writev(fd,&iov,1);
+	}
+	else if(retn>=0)
+	{
+		head_->zc_=true;
+		head_->zcid_=zcseq_++;
+	}
+	if(retn<0)
+	{
+		if(errno==EWOULDBLOCK||errno==EAGAIN)
+			return 1;
+		else
+			return -1;
+	}
+	head_->rpos_+=retn;
+	off_-=retn;
+	if(head_->readable()>0)
+		return 0;
+	BufferBlock* block=head_;
+	head_=block->next_;
+	if(!head_)
+		tail_=nullptr;
+	retire(block);
+	return 0;
+}
+
+// tcp reports completions in order,release every block whose last send is covered
+void net::Buffer::zerocopy_done(uint32_t lo,uint32_t hi)
+{
+	if((int32_t)(hi-zcdone_)>0)
+		zcdone_=hi;
+	while(zchead_&&(int32_t)(zchead_->zcid_-hi)<=0)
+	{
+		BufferBlock* block=zchead_;
+		zchead_=block->next_;
+		if(!zchead_)
+			zctail_=nullptr;
+		zcbytes_-=block->cap_;
+		pool_->release(block);
+	}
+}
+
+void net::Buffer::discard_unsent()
+{
+	while(head_)
+	{
+		BufferBlock* block=head_;
+		head_=block->next_;
+		retire(block);
+	}
+	tail_=nullptr;
+	off_=0;
+}
+
+void net::Buffer::abandon_zerocopy()
+{
+	zchead_=nullptr;
+	zctail_=nullptr;
+	zcbytes_=0;
+}
+
 int net::Buffer::readable(char*& pbuf)
 {
-	pbuf=buffer_;
-	return off_;
+	if(!head_)
+	{
+		pbuf=nullptr;
+		return 0;
+	}
+	pbuf=head_->data()+head_->rpos_;
+	return (int)head_->readable();
+}
+
+int net::Buffer::pullup(size_t len)
+{
+	if(!head_)
+		return 0;
+	if(len>off_)
+		len=off_;
+	if(head_->readable()>=len)
+		return (int)head_->readable();
+	BufferBlock* dst=head_;
+	bool fits=head_->cap_-head_->rpos_>=len;
+	// slices may point at the bytes in front,a shared block is never compacted in place
+	if(head_->cap_<len||(!fits&&head_->refs_.load(std::memory_order_acquire)!=1))
+	{
+		dst=pool_->alloc(len);
+		memcpy(dst->data(),head_->data()+head_->rpos_,head_->readable());
+		dst->wpos_=head_->readable();
+		dst->next_=head_->next_;
+		if(tail_==head_)
+			tail_=dst;
+		pool_->release(head_);
+		head_=dst;
+	}
+	else if(!fits)
+	{
+		memmove(head_->data(),head_->data()+head_->rpos_,head_->readable());
+		head_->wpos_-=head_->rpos_;
+		head_->rpos_=0;
+	}
+	while(dst->readable()<len)
+	{
+		BufferBlock* next=dst->next_;
+		size_t n=next->readable();
+		if(n>len-dst->readable())
+			n=len-dst->readable();
+		memcpy(dst->data()+dst->wpos_,next->data()+next->rpos_,n);
+		dst->wpos_+=n;
+		next->rpos_+=n;
+		if(next->readable()==0)
+		{
+			dst->next_=next->next_;
+			if(tail_==next)
+				tail_=dst;
+			pool_->release(next);
+		}
+	}
+	return (int)dst->readable();
 }
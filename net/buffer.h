@@ -1,33 +1,129 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
+#include <atomic>
+#include <assert.h>
+#include "socket.h"
 
 namespace net
 {
+	struct Msg;
+	class BufferPool;
+
+	// a pool block owns its data,a ref block points into a Msg payload kept alive
+	// in the block until it has been written out.
+	// refs_ is 1 for the buffer holding the block plus one per msg sliced from it
+	struct BufferBlock
+	{
+		BufferBlock* next_;
+		size_t       cap_;
+		size_t       rpos_;
+		size_t       wpos_;
+		char*        base_;
+		BufferPool*  pool_;
+		std::atomic<int> refs_;
+		bool         ref_;
+		bool         zc_;     // sent with MSG_ZEROCOPY,pages pinned until zcid_ completes
+		uint32_t     zcid_;
+		char*  data() {return base_;}
+		size_t readable() {return wpos_-rpos_;}
+		size_t writable() {return cap_-wpos_;}
+	};
+
+	// free list of fixed size blocks,one per io thread and only touched by it.
+	// connections borrow blocks only while they hold unread or unsent data
+	class BufferPool
+	{
+	public:
+		static const size_t ezBlockSize=16*1024;
+		explicit BufferPool(size_t blocksize=ezBlockSize,size_t maxfree=1024);
+		~BufferPool();
+		// size above the block size gets a dedicated block,freed on release
+		BufferBlock* alloc(size_t size=0);
+		// block referencing msg's payload,takes the msg over
+		BufferBlock* alloc_ref(Msg* msg);
+		// owner thread,a block with live slices is recycled by its last slice
+		void         release(BufferBlock* block);
+		// any thread,drop one slice reference
+		static void  release_slice(BufferBlock* block);
+		// take back the blocks whose last slice was freed on another thread
+		void         collect_remote();
+		// free the cached blocks that stayed unused since the last trim
+		void         trim();
+		size_t       block_size() {return blocksize_;}
+		// counters are written by the owner thread only,readable from any thread
+		int64_t      used_blocks() {return usedblocks_.load(std::memory_order_relaxed);}
+		int64_t      used_bytes() {return usedbytes_.load(std::memory_order_relaxed);}
+		int64_t      free_blocks() {return nfree_.load(std::memory_order_relaxed);}
+		int64_t      peak_bytes() {return peakbytes_.load(std::memory_order_relaxed);}
+	private:
+		void         account(int64_t blocks,int64_t bytes);
+		void         recycle(BufferBlock* block);
+	private:
+		size_t       blocksize_;
+		size_t       maxfree_;
+		size_t       minfree_;    // low water mark of the free list since the last trim
+		BufferBlock* free_;
+		std::atomic<BufferBlock*> remote_;
+		std::atomic<int64_t> nfree_;
+		std::atomic<int64_t> usedblocks_;
+		std::atomic<int64_t> usedbytes_;
+		std::atomic<int64_t> peakbytes_;
+	};
+
+	// chain of pool blocks,grows on demand and gives every block back as it drains,
+	// an idle connection holds no block. limit is a soft cap checked by the encoder through fastadd()
 	class Buffer
 	{
 	public:
-		static const size_t ezInitSize=128*1024;
-		explicit Buffer(size_t initSize=ezInitSize);
+		Buffer(BufferPool* pool,size_t limit);
 		~Buffer();
 		void drain(size_t len);
 		int  remove(void* data,size_t datlen);
-		void align();
-		int  maxadd();
 		int  fastadd();
-		int  expand(size_t datlen);
 		int  add(const void* data,size_t datlen);
+		// append msg's payload without copying,the msg is freed once fully drained
+		void add_ref(Msg* msg);
+		// init msg over size bytes at data,which must lie in the first block.
+		// the block stays out of the pool until msg and all its copies are freed
+		void slice(Msg* msg,char* data,int size);
+		// readv into the tail block plus a spare block
 		int  readfd(int fd);
-		int  writefd(int fd);
+		// writev across blocks until empty(0),would block(1) or error(-1).
+		// zcsize>0:ref blocks of at least zcsize bytes go out with MSG_ZEROCOPY
+		// and are held until zerocopy_done covers them
+		int  writefd(int fd,size_t zcsize=0);
+		void zerocopy_done(uint32_t lo,uint32_t hi);
+		size_t zerocopy_pending() {return zcbytes_;}
+		// the socket is closing:drop what was never sent,a block partly sent with
+		// MSG_ZEROCOPY joins the pending ones.the pages stay pinned until zerocopy_done
+		void discard_unsent();
+		// completions will never come,forget the pending blocks without touching their pages
+		void abandon_zerocopy();
+		// iovs over the first blocks,at most cnt,nothing is drained
+		int  peek(IoVec* iov,int cnt);
+		// contiguous bytes at the front
 		int  readable(char*& pbuf);
+		// make the first len bytes contiguous,return the new readable size
+		int  pullup(size_t len);
 		size_t off() {return off_;}
+		// an empty buffer holds no block,it may switch to another thread's pool
+		void set_pool(BufferPool* pool) {assert(!head_&&!zchead_);pool_=pool;}
 	private:
-		char *buffer_;
-		char *orig_buffer_;
-
-		size_t misalign_;
-		size_t totallen_;
-		size_t off_;
+		BufferBlock* append_block();
+		int  write_zerocopy(int fd);
+		void retire(BufferBlock* block);
+	private:
+		BufferPool*  pool_;
+		BufferBlock* head_;
+		BufferBlock* tail_;
+		size_t       off_;
+		size_t       limit_;
+		BufferBlock* zchead_;
+		BufferBlock* zctail_;
+		uint32_t     zcseq_;
+		uint32_t     zcdone_;   // highest completed send id
+		size_t       zcbytes_;
 	};
 }
 
-#endif
\ No newline at end of file
+#endif
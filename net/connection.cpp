@@ -1,6 +1,9 @@
 #include "../base/portable.h"
 #include "../base/memorystream.h"
 #include "../base/logging.h"
+#include "../base/likely.h"
+#include <stdexcept>
+#include "../base/varint.h"
 #include "connection.h"
 #include "netpack.h"
 #include "event.h"
@@ -11,10 +14,14 @@
 
 using namespace net;
 
+// msgs handed to on_data_batch per call
+static const int ezDeliverBatch=64;
+
 net::Connection::Connection(EventLoop* looper,ClientFd* client,int tid,int64_t userdata):ThreadEventHander(looper,tid)
   ,client_(client)
   ,gameObj_(nullptr)
   ,userdata_(userdata)
+  ,dirty_(false)
 {}
 
 net::Connection::~Connection()
@@ -42,15 +49,80 @@ void net::Connection::dettach_game_object()
 
 void net::Connection::send_msg(Msg& msg)
 {
-  if(client_)
+  if(!queue_msg(msg))
+    return;
+  if(get_looper()->is_auto_flush()||get_looper()->has_flag(EVLOOP_IO_HANDLER))
+    flush();
+  else
+    mark_dirty();
+}
+
+bool net::Connection::queue_msg(Msg& msg)
+{
+  if(!client_)
+  {
+    msg_free(&msg);
+    return false;
+  }
+  EventLoop* looper=get_looper();
+  int64_t high=looper->get_send_high();
+  if(high<=0)
   {
     client_->send_msg(msg);
-    ThreadEvent ev;
-    ev.type_=ThreadEvent::ENABLE_POLLOUT;
-    client_->occur_event(ev);
+    return true;
   }
-  else
+  int policy=looper->get_slow_policy();
+  if(policy==SLOW_CONSUMER_DROP&&msg_is_droppable(&msg)&&client_->pending_bytes()>=high)
+  {
     msg_free(&msg);
+    return false;
+  }
+  client_->send_msg(msg);
+  int64_t pending=client_->pending_bytes();
+  if(pending<high||!client_->mark_above_high())
+    return true;
+  looper->get_hander()->on_high_watermark(this,pending);
+  if(policy==SLOW_CONSUMER_CLOSE&&client_)
+  {
+    LOG_WARN("close slow consumer %s,%lld bytes pending",ip_.c_str(),(long long)pending);
+    if(!looper->defer_close(this))
+      close_client();
+    return false;
+  }
+  return client_!=nullptr;
+}
+
+void net::Connection::mark_dirty()
+{
+  if(!dirty_)
+  {
+    dirty_=true;
+    get_looper()->add_dirty_connection(this);
+  }
+}
+
+void net::Connection::flush()
+{
+  // EVLOOP_IO_HANDLER,we are on the client's thread already
+  if(client_&&get_looper()->has_flag(EVLOOP_IO_HANDLER))
+  {
+    client_->write_inline();
+    return;
+  }
+  ThreadEvent ev;
+  if(prepare_flush(ev))
+    client_->occur_event(ev);
+}
+
+bool net::Connection::prepare_flush(ThreadEvent& ev)
+{
+  dirty_=false;
+  if(!client_||!client_->mark_flush_pending())
+    return false;
+  ev.type_=ThreadEvent::ENABLE_POLLOUT;
+  ev.hander_=client_;
+  client_->add_ref();
+  return true;
 }
 
 bool net::Connection::recv_msg(Msg& msg)
@@ -66,6 +138,8 @@ void net::Connection::active_close()
   Msg msg;
   msg_init_delimiter(&msg);
   send_msg(msg);
+  // don't wait for the end-of-tick flush to close
+  flush();
 }
 
 void net::Connection::close_client()
@@ -74,15 +148,33 @@ void net::Connection::close_client()
   {
     ThreadEvent ev;
     ev.type_=ThreadEvent::CLOSE_FD;
+    client_->add_ref();
     client_->occur_event(ev);
     client_=nullptr;
   }
 }
 
+void net::Connection::deliver_messages(IConnnectionHander* hander)
+{
+  Msg msgs[ezDeliverBatch];
+  while(true)
+  {
+    int n=0;
+    while(n<ezDeliverBatch&&recv_msg(msgs[n]))
+      ++n;
+    if(n==0)
+      break;
+    hander->on_data_batch(this,msgs,n);
+    for(int i=0;i<n;++i)
+      msg_free(&msgs[i]);
+    if(n<ezDeliverBatch)
+      break;
+  }
+}
+
 void net::Connection::process_event(ThreadEvent& ev)
 {
   IConnnectionHander* hander=get_looper()->get_hander();
-  Msg msg;
   switch(ev.type_)
   {
   case ThreadEvent::NEW_CONNECTION:
@@ -91,11 +183,7 @@ void net::Connection::process_event(ThreadEvent& ev)
     break;
   case ThreadEvent::CLOSE_PASSIVE:
   case ThreadEvent::CLOSE_ACTIVE:
-    while(recv_msg(msg))
-    {
-      hander->on_data(this,&msg);
-      msg_free(&msg);
-    }
+    deliver_messages(hander);
     close_client();
     break;
   case ThreadEvent::CLOSE_CONNECTION:
@@ -103,12 +191,14 @@ void net::Connection::process_event(ThreadEvent& ev)
     get_looper()->del_connection(this);
     delete this;
     break;
+  case ThreadEvent::LOW_WATERMARK:
+    if(client_)
+      hander->on_low_watermark(this,client_->pending_bytes());
+    break;
   case ThreadEvent::NEW_MESSAGE:
-    while(recv_msg(msg))
-    {
-      hander->on_data(this,&msg);
-      msg_free(&msg);
-    }
+    if(client_)
+      client_->ack_new_message();
+    deliver_messages(hander);
     break;
   default:
     break;
@@ -120,6 +210,43 @@ int64_t net::Connection::get_user_data()
   return userdata_;
 }
 
+void net::BroadcastTask::add_target(ClientFd* client)
+{
+  client->add_ref();
+  targets_.push_back(client);
+}
+
+// io thread,each target is flushed as if it got its own ENABLE_POLLOUT,one that moved
+// to another thread or was closed meanwhile is passed on or dropped with its reference
+void net::BroadcastTask::process_event(ThreadEvent& ev)
+{
+  for(size_t i=0;i<targets_.size();++i)
+  {
+    ThreadEvent flushev;
+    flushev.type_=ThreadEvent::ENABLE_POLLOUT;
+    flushev.hander_=targets_[i];
+    targets_[i]->process_event(flushev);
+  }
+  delete this;
+}
+
+void net::IConnnectionHander::on_data_batch(Connection* conn,Msg* msgs,int n)
+{
+  for(int i=0;i<n;++i)
+    on_data(conn,&msgs[i]);
+}
+
+int net::IConnnectionHander::select_shard(int64_t userdata,const char* ipport,int shards)
+{
+  if(userdata!=0)
+    return (int)((uint64_t)userdata%(uint64_t)shards);
+  // FNV-1a
+  uint32_t h=2166136261u;
+  for(const char* p=ipport;*p;++p)
+    h=(h^(uint8_t)*p)*16777619u;
+  return (int)(h%(uint32_t)shards);
+}
+
 void net::ServerHander::on_open(Connection* conn)
 {
   LOG_INFO("new connector from %s",conn->get_ip_addr().c_str());
@@ -180,6 +307,26 @@ void net::ClientHander::on_data(Connection* conn,Msg* msg)
 }
 
 int net::MsgDecoder::decode(IMessagePusher* pusher,char* buf,size_t s)
+{
+  return decode_frames(pusher,nullptr,buf,s);
+}
+
+int net::MsgDecoder::decode_buffer(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s)
+{
+  return decode_frames(pusher,slicesize_>0?buffer:nullptr,buf,s);
+}
+
+int net::MsgDecoder::frame_size(const char* buf,size_t s)
+{
+  if(s<sizeof(uint16_t))
+    return 0;
+  uint16_t msglen=0;
+  memcpy(&msglen,buf,sizeof(msglen));
+  return (int)sizeof(uint16_t)+msglen;
+}
+
+// buffer!=nullptr:large payloads are sliced out of it
+int net::MsgDecoder::decode_frames(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s)
 {
   base::BufferReader reader(buf,s);
   int retlen=0;
@@ -194,8 +341,18 @@ int net::MsgDecoder::decode(IMessagePusher* pusher,char* buf,size_t s)
     if(!reader.can_increase_size(msglen))
       break;
     Msg msg;
-    msg_init_size(&msg,msglen);
-    reader.read_buffer((char*)msg_data(&msg),msglen);
+    char* payload=reader.get_buffer()+reader.get_used_size();
+    // short payloads fit in the msg itself,copying is cheaper than pinning the block
+    if(buffer&&msglen>=slicesize_&&msglen>ezMsgInlineSize)
+    {
+      buffer->slice(&msg,payload,msglen);
+      reader.increase_size(msglen);
+    }
+    else
+    {
+      msg_init_size(&msg,msglen);
+      reader.read_buffer((char*)msg_data(&msg),msglen);
+    }
     retlen+=sizeof(uint16_t);
     retlen+=msglen;
     pusher->push_msg(&msg);
@@ -203,20 +360,154 @@ int net::MsgDecoder::decode(IMessagePusher* pusher,char* buf,size_t s)
   return retlen;
 }
 
-bool net::MsgEncoder::encode(IMessagePuller* puller,Buffer* buffer)
+int net::VarMsgDecoder::decode(IMessagePusher* pusher,char* buf,size_t s)
 {
-  Msg msg;
+  return decode_frames(pusher,nullptr,buf,s);
+}
+
+int net::VarMsgDecoder::decode_buffer(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s)
+{
+  return decode_frames(pusher,slicesize_>0?buffer:nullptr,buf,s);
+}
+
+int net::VarMsgDecoder::frame_size(const char* buf,size_t s)
+{
+  size_t hdr=0;
+  while(hdr<s&&hdr<base::kMaxVarintLength32&&((uint8_t)buf[hdr]&0x80))
+    ++hdr;
+  if(hdr==base::kMaxVarintLength32)
+    return -1;
+  if(hdr==s)
+    return 0;
+  ++hdr;
+  uint64_t msglen=base::DecodeVarint((uint8_t*)buf,hdr);
+  return msglen>(uint64_t)maxMsgSize_?-1:(int)(hdr+msglen);
+}
+
+// a frame that has not fully arrived is allocated at its final size and filled across calls,
+// it's never pulled up in the receive buffer first
+int net::VarMsgDecoder::decode_frames(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s)
+{
+  size_t pos=0;
+  PartialMsg* part=pusher->get_partial();
+  if(part&&part->active_)
+  {
+    size_t n=msg_size(&part->msg_)-part->filled_;
+    if(n>s)
+      n=s;
+    memcpy(msg_data(&part->msg_)+part->filled_,buf,n);
+    part->filled_+=(uint32_t)n;
+    pos=n;
+    if(part->filled_<(uint32_t)msg_size(&part->msg_))
+      return (int)pos;
+    part->active_=false;
+    pusher->push_msg(&part->msg_);
+    msg_init(&part->msg_);
+  }
+  while(pos<s)
+  {
+    // the length ends at the first byte without the continuation bit
+    size_t hdr=0;
+    while(hdr<s-pos&&hdr<base::kMaxVarintLength32&&((uint8_t)buf[pos+hdr]&0x80))
+      ++hdr;
+    if(hdr==base::kMaxVarintLength32)
+      return -1;
+    if(hdr==s-pos)
+      break;
+    ++hdr;
+    uint64_t msglen=base::DecodeVarint((uint8_t*)buf+pos,hdr);
+    if(msglen==0||msglen>maxMsgSize_)
+      return -1;
+    char* payload=buf+pos+hdr;
+    size_t avail=s-pos-hdr;
+    Msg msg;
+    if(avail<msglen)
+    {
+      if(!part||msglen<=(uint64_t)ezMsgInlineSize)
+        break;
+      msg_init_size(&msg,(int)msglen);
+      memcpy(msg_data(&msg),payload,avail);
+      part->msg_=msg;
+      part->filled_=(uint32_t)avail;
+      part->active_=true;
+      return (int)s;
+    }
+    if(buffer&&msglen>=(uint64_t)slicesize_&&msglen>(uint64_t)ezMsgInlineSize)
+      buffer->slice(&msg,payload,(int)msglen);
+    else
+    {
+      msg_init_size(&msg,(int)msglen);
+      memcpy(msg_data(&msg),payload,msglen);
+    }
+    pusher->push_msg(&msg);
+    pos+=hdr+msglen;
+  }
+  return (int)pos;
+}
+
+// length prefix for msize,varint or uint16_t.0 if msize doesn't fit
+static size_t frame_header(int msize,bool varint,uint8_t* hdr)
+{
+  if(varint)
+    return base::EncodeVarint((uint64_t)msize,hdr);
+  if(msize>0xffff)
+  {
+    LOG_ERROR("msg size %d too large for a uint16_t frame,dropped",msize);
+    return 0;
+  }
+  uint16_t len=(uint16_t)msize;
+  memcpy(hdr,&len,sizeof(len));
+  return sizeof(len);
+}
+
+static bool encode_frame_msg(net::Msg* msg,net::Msg* frame,bool varint)
+{
+  uint8_t hdr[base::kMaxVarintLength32];
+  int msize=net::msg_size(msg);
+  size_t hlen=frame_header(msize,varint,hdr);
+  if(hlen==0)
+    return false;
+  net::msg_init_size(frame,(int)hlen+msize);
+  memcpy(net::msg_data(frame),hdr,hlen);
+  memcpy(net::msg_data(frame)+hlen,net::msg_data(msg),msize);
+  net::msg_set_encoded(frame);
+  return true;
+}
+
+// shared by both framings,varint:length prefix is a varint instead of a uint16_t.
+// an encoded msg(broadcast) is written as is
+static bool encode_msgs(net::IMessagePuller* puller,net::Buffer* buffer,int refsize,bool varint)
+{
+  net::Msg msg;
   while(puller->pull_msg(&msg))
   {
-    if(msg_is_delimiter(&msg))
+    if(net::msg_is_delimiter(&msg))
       return false;
     int canadd=buffer->fastadd();
-    uint16_t msize=(uint16_t)msg_size(&msg);
-    if(int(sizeof(uint16_t)+msize)<=canadd)
+    int msize=net::msg_size(&msg);
+    uint8_t hdr[base::kMaxVarintLength32];
+    size_t hlen=0;
+    if(!net::msg_is_encoded(&msg))
     {
-      buffer->add(&msize,sizeof(msize));
-      buffer->add(msg_data(&msg),msize);
-      msg_free(&msg);
+      hlen=frame_header(msize,varint,hdr);
+      if(hlen==0)
+      {
+        net::msg_free(&msg);
+        continue;
+      }
+    }
+    // the buffer grows,a frame larger than the limit still goes out on its own
+    if(int(hlen+msize)<=canadd||buffer->off()==0)
+    {
+      if(hlen>0)
+        buffer->add(hdr,hlen);
+      if(refsize>0&&msize>=refsize)
+        buffer->add_ref(&msg);
+      else
+      {
+        buffer->add(net::msg_data(&msg),msize);
+        net::msg_free(&msg);
+      }
     }
     else
     {
@@ -227,6 +518,26 @@ bool net::MsgEncoder::encode(IMessagePuller* puller,Buffer* buffer)
   return true;
 }
 
+bool net::MsgEncoder::encode(IMessagePuller* puller,Buffer* buffer)
+{
+  return encode_msgs(puller,buffer,refsize_,false);
+}
+
+bool net::MsgEncoder::encode_frame(Msg* msg,Msg* frame)
+{
+  return encode_frame_msg(msg,frame,false);
+}
+
+bool net::VarMsgEncoder::encode(IMessagePuller* puller,Buffer* buffer)
+{
+  return encode_msgs(puller,buffer,refsize_,true);
+}
+
+bool net::VarMsgEncoder::encode_frame(Msg* msg,Msg* frame)
+{
+  return encode_frame_msg(msg,frame,true);
+}
+
 net::GameObject*  net::get_game_object(net::Connection* conn)
 {
   return conn->get_game_object();
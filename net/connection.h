@@ -26,15 +26,44 @@ namespace net
     const std::string& get_ip_addr() {return ip_;}
     int64_t get_user_data();
     void send_msg(Msg& msg);
+    // queue msg without flushing,applies the slow consumer policy.
+    // false if msg was dropped or the connection is closed
+    bool queue_msg(Msg& msg);
     bool recv_msg(Msg& msg);
+    ClientFd* get_client() {return client_;}
+    // queued messages need a flush,at the end of the tick when auto flush is off
+    void mark_dirty();
+    std::vector<std::string>& get_groups() {return groups_;}
+    // hand queued messages to the io thread now
+    void flush();
+    // clear the dirty mark,true if ev has to be posted to the io thread
+    bool prepare_flush(ThreadEvent& ev);
+    bool is_dirty() {return dirty_;}
     virtual void process_event(ThreadEvent& ev);
-  private:
+    // post CLOSE_FD and let go of the client
     void close_client();
+  private:
+    void deliver_messages(IConnnectionHander* hander);
   private:
     ClientFd* client_;
     std::string ip_;
     GameObject* gameObj_;
     int64_t userdata_;
+    // queued messages waiting for event_flush,auto flush off only
+    bool dirty_;
+    std::vector<std::string> groups_;
+  };
+
+  // targets of a broadcast on one io thread,their frames are queued already
+  class BroadcastTask:public ThreadEventHander
+  {
+  public:
+    BroadcastTask(EventLoop* looper,int tid):ThreadEventHander(looper,tid){}
+    // holds a reference to client until the task has run
+    void add_target(ClientFd* client);
+    virtual void process_event(ThreadEvent& ev);
+  private:
+    std::vector<ClientFd*> targets_;
   };
 }
 #endif
\ No newline at end of file
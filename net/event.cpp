@@ -5,12 +5,15 @@
 #include "connection.h"
 #include "fd.h"
 #include "iothread.h"
+#include "msgpool.h"
+#include "shard.h"
 #include "../base/memorystream.h"
 #include "../base/thread.h"
 #include "../base/logging.h"
 #include "../base/util.h"
 #include "../base/eztime.h"
 #include <assert.h>
+#include <algorithm>
 
 namespace net
 {
@@ -37,6 +40,7 @@ namespace net
       case ThreadEvent::NEW_CONNECTTO:
       case ThreadEvent::NEW_FD:
       case ThreadEvent::NEW_CONNECTION:
+      case ThreadEvent::FLUSH_SHARD:
         delete ev.hander_;
         break;
       default: break;
@@ -47,13 +51,27 @@ namespace net
 
 net::EventLoop::EventLoop()
 {
-  poller_=nullptr;
   shutdown_=false;
 	hander_=nullptr;
   closehander_=new ezCloseHander;
   threadnum_=0;
-  mainevqueue_=new ThreadEvQueue;
+  evqueues_=nullptr;
+  shards_=nullptr;
+  shardnum_=0;
   buffersize_=16*1024;
+  flags_=0;
+  busypoll_=0;
+  acceptbudget_=64;
+  zerocopy_=0;
+  sendlow_=0;
+  sendhigh_=0;
+  slowpolicy_=SLOW_CONSUMER_NONE;
+  placement_=nullptr;
+  rebalanceinterval_=0;
+  rebalanceratio_=0;
+  rebalancemin_=0;
+  nextrebalance_=0;
+  autoflush_=true;
 }
 
 net::EventLoop::~EventLoop()
@@ -64,42 +82,97 @@ net::EventLoop::~EventLoop()
   if(encoder_) delete encoder_;
   */
   if(closehander_) delete closehander_;
-  for(int i=0;i<=threadnum_;++i)
+  for(int i=0;i<threadnum_+shardnum_;++i)
     CleanThreadEvQueue(evqueues_[i]);
   for(int i=0;i<threadnum_;++i)
     delete threads_[i];
+  for(int i=0;i<shardnum_;++i)
+    delete shards_[i];
   delete [] evqueues_;
   delete [] threads_;
-  if(mainevqueue_) delete mainevqueue_;
-  if(poller_) delete poller_;
+  delete [] shards_;
 }
 
-int net::EventLoop::initialize(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum)
+int net::EventLoop::initialize(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum,int flags,int shards,const int* cpus)
 {
 	hander_=hander;
   decoder_=decoder;
   encoder_=encoder;
   threadnum_=tnum;
+  flags_=flags;
+  cpus_.assign(tnum+1,-1);
+  nodes_.assign(tnum+1,-1);
+  if(cpus)
+  {
+    // looked up once,sysfs is no place to go on every accept
+    if(has_flag(EVLOOP_INCOMING_CPU))
+    {
+      cpunodes_.resize(base::Threads::cpu_count());
+      for(int c=0;c<(int)cpunodes_.size();++c)
+        cpunodes_[c]=base::Threads::cpu_node(c);
+    }
+    for(int i=0;i<=tnum;++i)
+    {
+      cpus_[i]=cpus[i];
+      nodes_[i]=cpus[i]>=0?base::Threads::cpu_node(cpus[i]):-1;
+    }
+    if(cpus_[0]>=0&&!base::Threads::bind_current_thread(cpus_[0]))
+      LOG_WARN("can't bind the main thread to cpu %d",cpus_[0]);
+  }
   threads_=new IoThread*[tnum];
   for(int i=0;i<tnum;++i)
   {
     threads_[i]=new IoThread(this,i+1);
+    // bound before it runs,the pool blocks and msg caches it allocates are node local
+    threads_[i]->set_cpu(cpus_[i+1]);
     threads_[i]->start();
   }
-  evqueues_=new ThreadEvQueue*[tnum+1];
-  evqueues_[0]=mainevqueue_;
+  shardnum_=shards>0?shards:1;
+  shards_=new LogicShard*[shardnum_];
+  for(int i=0;i<shardnum_;++i)
+    shards_[i]=new LogicShard(this,i);
+  evqueues_=new ThreadEvQueue*[tnum+shardnum_];
+  for(int i=0;i<shardnum_;++i)
+  {
+    evqueues_[get_shard_tid(i)]=shards_[i]->get_ev_queue();
+  }
   for(int i=1;i<=tnum;++i)
   {
     evqueues_[i]=get_thread(i)->get_ev_queue();
   }
-  poller_=create_poller();
-  poller_->add_fd(mainevqueue_->get_fd(),this);
-  poller_->set_poll_in(mainevqueue_->get_fd());
 	return 0;
 }
 
 int net::EventLoop::serve_on_port(int port)
 {
+#ifdef SO_REUSEPORT
+  if(has_flag(EVLOOP_REUSEPORT))
+  {
+    std::vector<SOCKET> socks;
+    for(int i=0;i<threadnum_;++i)
+    {
+      SOCKET s=CreateTcpServer(port,nullptr,true);
+      if(s==INVALID_SOCKET)
+      {
+        for(size_t j=0;j<socks.size();++j)
+          CloseSocket(socks[j]);
+        return -1;
+      }
+      // the kernel prefers the listener whose cpu took the syn
+      if(has_flag(EVLOOP_INCOMING_CPU)&&cpus_[i+1]>=0)
+        SetIncomingCpu(s,cpus_[i+1]);
+      socks.push_back(s);
+    }
+    for(int i=0;i<threadnum_;++i)
+    {
+      ThreadEvent ev;
+      ev.type_=ThreadEvent::NEW_SERVICE;
+      ev.hander_=new ezListenerFd(this,threads_[i],socks[i]);
+      ev.hander_->occur_event(ev);
+    }
+    return 0;
+  }
+#endif
   SOCKET s=CreateTcpServer(port,nullptr);
   if(s==INVALID_SOCKET)
     return -1;
@@ -113,7 +186,7 @@ int net::EventLoop::serve_on_port(int port)
 
 int net::EventLoop::connect_to(const std::string& ip,int port,int64_t userdata,int32_t reconnect)
 {
-  IoThread* thread=choose_thread();
+  IoThread* thread=choose_thread(userdata);
   ThreadEvent ev;
   ev.type_=ThreadEvent::NEW_CONNECTTO;
   ezConnectToFd* conn=new ezConnectToFd(this,thread,userdata,reconnect);
@@ -133,14 +206,17 @@ int net::EventLoop::shutdown()
     ev.type_=ThreadEvent::STOP_FLASHEDFD;
     threads_[i]->occur_event(ev);
   }
-  for(auto iter=conns_.begin();iter!=conns_.end();++iter)
+  // io thread connections are closed by their thread on STOP_FLASHEDFD.the shard threads
+  // are stopped by now,their queues are drained from here
+  if(!has_flag(EVLOOP_IO_HANDLER))
   {
-    (*iter)->active_close();
+    for(int i=0;i<shardnum_;++i)
+      shards_[i]->close_connections();
   }
-  while(!conns_.empty())
+  while(get_connection_num()>0)
   {
-    loop();
-    base::sleep(1);
+    for(int i=0;i<shardnum_;++i)
+      shards_[i]->loop(i==0?1:0);
   }
   for(int i=0;i<threadnum_;++i)
   {
@@ -160,10 +236,16 @@ uint64_t net::UUID::uuid()
 
 void net::EventLoop::occer_event(int tid,ThreadEvent& ev)
 {
-  assert(tid<=threadnum_);
+  assert(tid<threadnum_+shardnum_);
   evqueues_[tid]->send(ev);
 }
 
+void net::EventLoop::occer_events(int tid,ThreadEvent* evs,int n)
+{
+  assert(tid<threadnum_+shardnum_);
+  evqueues_[tid]->send(evs,n);
+}
+
 net::IoThread* net::EventLoop::get_thread(int idx)
 {
   if(idx>0&&idx<=threadnum_)
@@ -172,63 +254,283 @@ net::IoThread* net::EventLoop::get_thread(int idx)
     return NULL;
 }
 
-net::IoThread* net::EventLoop::choose_thread()
+// a new fd is assumed to cost about this many usec per second until it shows its traffic
+static const int64_t ezLoadPerFd=50;
+
+// one kb moved or one msg coded is taken as a usec of work
+static int64_t load_score(const net::IoThreadLoad& load)
+{
+  return load.cpuusec_+load.bytes_/1024+load.msgs_+load.fds_*ezLoadPerFd;
+}
+
+// xorshift,per thread since listeners pick threads concurrently
+static uint32_t next_random()
+{
+  static thread_local uint32_t state=0;
+  if(state==0)
+    state=((uint32_t)base::now_usec()^(uint32_t)(uintptr_t)&state)|1;
+  state^=state<<13;
+  state^=state>>17;
+  state^=state<<5;
+  return state;
+}
+
+net::IoThread* net::EventLoop::choose_thread(int64_t userdata)
+{
+  if(threadnum_==1)
+    return threads_[0];
+  IPlacementPolicy* policy=placement_.load(std::memory_order_acquire);
+  if(policy)
+  {
+    std::vector<IoThreadLoad> loads(threadnum_);
+    for(int i=0;i<threadnum_;++i)
+      threads_[i]->get_load_stats(&loads[i]);
+    int idx=policy->choose_thread(loads.data(),threadnum_,userdata);
+    if(idx>=0&&idx<threadnum_)
+    {
+      threads_[idx]->add_incoming();
+      return threads_[idx];
+    }
+  }
+  // power of two choices,unlike the least loaded thread overall a burst of new
+  // connections doesn't all land on the one that looked idle at the last sample
+  int a=(int)(next_random()%threadnum_);
+  int b=(int)(next_random()%(threadnum_-1));
+  if(b>=a)
+    ++b;
+  IoThreadLoad la,lb;
+  threads_[a]->get_load_stats(&la);
+  threads_[b]->get_load_stats(&lb);
+  IoThread* io=threads_[load_score(la)<=load_score(lb)?a:b];
+  io->add_incoming();
+  return io;
+}
+
+net::IoThread* net::EventLoop::thread_for_cpu(int cpu)
 {
-  int idx=0;
-  int minload=threads_[idx]->get_load();
+  if(cpu<0)
+    return nullptr;
+  bool oncpu=false;
+  for(int i=0;i<threadnum_&&!oncpu;++i)
+    oncpu=cpus_[i+1]==cpu;
+  // the least loaded thread on that core,else on its node.a cpu of unknown node is
+  // left to choose_thread
+  int node=-1;
+  if(!oncpu)
+  {
+    if(cpu>=(int)cpunodes_.size()||cpunodes_[cpu]<0)
+      return nullptr;
+    node=cpunodes_[cpu];
+  }
+  IoThread* best=nullptr;
+  int64_t bestscore=0;
   for(int i=0;i<threadnum_;++i)
   {
-    if(threads_[i]->get_load()<minload)
+    if(cpus_[i+1]<0||(oncpu?cpus_[i+1]!=cpu:nodes_[i+1]!=node))
+      continue;
+    IoThreadLoad load;
+    threads_[i]->get_load_stats(&load);
+    int64_t score=load_score(load);
+    if(!best||score<bestscore)
     {
-      minload=threads_[i]->get_load();
-      idx=i;
+      best=threads_[i];
+      bestscore=score;
     }
   }
-  return threads_[idx];
+  if(best)
+    best->add_incoming();
+  return best;
 }
 
-void net::EventLoop::loop()
+void net::EventLoop::set_rebalance(int intervalms,int ratio,int64_t minload)
 {
-  poller_->poll();
+  rebalanceratio_.store(ratio>100?ratio:100,std::memory_order_relaxed);
+  rebalancemin_.store(minload>0?minload:0,std::memory_order_relaxed);
+  rebalanceinterval_.store(intervalms>0?intervalms:0,std::memory_order_relaxed);
+  nextrebalance_=base::now_usec()+(int64_t)(intervalms>0?intervalms:0)*1000;
+}
+
+// one connection per round from the busiest io thread to the idlest,the rates need a
+// second or so to show the move before the next one
+void net::EventLoop::rebalance()
+{
+  if(threadnum_<2||has_flag(EVLOOP_IO_HANDLER))
+    return;
+  int hot=0,cold=0;
+  int64_t hotscore=0,coldscore=0;
+  for(int i=0;i<threadnum_;++i)
+  {
+    IoThreadLoad load;
+    threads_[i]->get_load_stats(&load);
+    int64_t score=load_score(load);
+    if(i==0||score>hotscore)
+    {
+      hot=i;
+      hotscore=score;
+    }
+    if(i==0||score<coldscore)
+    {
+      cold=i;
+      coldscore=score;
+    }
+  }
+  int64_t minload=rebalancemin_.load(std::memory_order_relaxed);
+  int ratio=rebalanceratio_.load(std::memory_order_relaxed);
+  if(hotscore-coldscore<minload||hotscore*100<=coldscore*ratio)
+    return;
+  // half the gap leaves both threads even
+  int permille=(int)((hotscore-coldscore)*500/hotscore);
+  threads_[hot]->request_rebalance(threads_[cold]->get_tid(),permille);
+}
+
+void net::EventLoop::loop(int maxwait)
+{
+  loop_shard(0,maxwait);
+  int interval=rebalanceinterval_.load(std::memory_order_relaxed);
+  if(interval<=0)
+    return;
+  int64_t now=base::now_usec();
+  if(now>=nextrebalance_)
+  {
+    rebalance();
+    nextrebalance_=now+(int64_t)interval*1000;
+  }
+}
+
+void net::EventLoop::loop_shard(int shard,int maxwait)
+{
+  shards_[shard]->loop(maxwait);
+}
+
+net::LogicShard* net::EventLoop::shard_of(Connection* con)
+{
+  return shards_[get_shard_index(con->get_tid())];
+}
+
+int net::EventLoop::choose_shard(int64_t userdata,const char* ipport)
+{
+  if(shardnum_<=1)
+    return 0;
+  int shard=hander_->select_shard(userdata,ipport,shardnum_);
+  return (shard>=0&&shard<shardnum_)?shard:0;
+}
+
+void net::EventLoop::post_to_shard(int shard,Msg* msg)
+{
+  if(shard<0||shard>=shardnum_)
+  {
+    msg_free(msg);
+    return;
+  }
+  ShardMsgTask* task=new ShardMsgTask(this,shard,msg);
+  ThreadEvent ev;
+  ev.type_=ThreadEvent::SHARD_MESSAGE;
+  task->occur_event(ev);
 }
 
 void net::EventLoop::add_connection(Connection* con)
 {
   if(shutdown_)
     return;
-  assert(conns_.find(con)==conns_.end());
-  conns_.insert(con);
+  shard_of(con)->add_connection(con);
 }
 
 void net::EventLoop::del_connection(Connection* con)
 {
-  auto iter=conns_.find(con);
-  assert(iter!=conns_.end());
-  conns_.erase(iter);
+  shard_of(con)->del_connection(con);
 }
 
-int net::EventLoop::get_connection_num()
+void net::EventLoop::add_dirty_connection(Connection* con)
 {
-  return conns_.size();
+  shard_of(con)->add_dirty_connection(con);
 }
 
-int net::EventLoop::get_buffer_size()
+void net::EventLoop::set_auto_flush(bool on)
 {
-  return buffersize_;
+  autoflush_=on;
+  if(!on)
+    return;
+  flush_connections(0);
+  // the other shards flush what they marked dirty on their own threads
+  for(int i=1;i<shardnum_;++i)
+  {
+    ThreadEvent ev;
+    ev.type_=ThreadEvent::FLUSH_SHARD;
+    ev.hander_=new ShardFlushTask(this,i);
+    ev.hander_->occur_event(ev);
+  }
 }
 
-void net::EventLoop::set_buffer_size(int s)
+void net::EventLoop::set_send_watermark(int64_t low,int64_t high,int policy)
 {
-  buffersize_=s;
+  if(high<0)
+    high=0;
+  if(low<0||low>high)
+    low=high;
+  sendlow_.store(low,std::memory_order_relaxed);
+  sendhigh_.store(high,std::memory_order_relaxed);
+  slowpolicy_.store(policy,std::memory_order_relaxed);
 }
 
-void net::EventLoop::handle_in_event()
+void net::EventLoop::broadcast(Connection** conns,int n,Msg* msg)
 {
-  ThreadEvent ev;
-  while(mainevqueue_->recv(ev))
+  if(n<=0)
+  {
+    msg_free(msg);
+    return;
+  }
+  shard_of(conns[0])->broadcast(conns,n,msg);
+}
+
+bool net::EventLoop::defer_close(Connection* con)
+{
+  if(has_flag(EVLOOP_IO_HANDLER))
+    return false;
+  return shard_of(con)->defer_close(con);
+}
+
+void net::EventLoop::join_group(const std::string& group,Connection* con)
+{
+  shard_of(con)->join_group(group,con);
+}
+
+void net::EventLoop::leave_group(const std::string& group,Connection* con)
+{
+  shard_of(con)->leave_group(group,con);
+}
+
+void net::EventLoop::group_broadcast(int shard,const std::string& group,Msg* msg)
+{
+  if(shard<0||shard>=shardnum_)
   {
-    ev.hander_->process_event(ev);
+    msg_free(msg);
+    return;
   }
+  shards_[shard]->group_broadcast(group,msg);
+}
+
+void net::EventLoop::flush_connections(int shard)
+{
+  if(shard>=0&&shard<shardnum_)
+    shards_[shard]->flush_connections();
+}
+
+int net::EventLoop::get_connection_num()
+{
+  int n=0;
+  for(int i=0;i<shardnum_;++i)
+    n+=shards_[i]->get_connection_num();
+  return n;
+}
+
+int net::EventLoop::get_buffer_size()
+{
+  return buffersize_;
+}
+
+void net::EventLoop::set_buffer_size(int s)
+{
+  buffersize_=s;
 }
 
 net::ThreadEventHander::ThreadEventHander(EventLoop* loop,int tid):looper_(loop),tid_(tid)
@@ -237,7 +539,7 @@ net::ThreadEventHander::ThreadEventHander(EventLoop* loop,int tid):looper_(loop)
 void net::ThreadEventHander::occur_event(ThreadEvent& ev)
 {
   ev.hander_=this;
-  looper_->occer_event(tid_,ev);
+  looper_->occer_event(get_tid(),ev);
 }
 
 void  net::net_initialize()
@@ -245,10 +547,10 @@ void  net::net_initialize()
   net::InitNetwork();
 }
 
-net::EventLoop* net::create_event_loop(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum)
+net::EventLoop* net::create_event_loop(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum,int flags,int shards,const int* cpus)
 {
   net::EventLoop* ev=new net::EventLoop;
-  ev->initialize(hander,decoder,encoder,tnum);
+  ev->initialize(hander,decoder,encoder,tnum,flags,shards,cpus);
   return ev;
 }
 
@@ -257,6 +559,79 @@ void net::set_msg_buffer_size(EventLoop* loop,int size)
   loop->set_buffer_size(size);
 }
 
+void net::set_busy_poll(EventLoop* loop,int usec)
+{
+  loop->set_busy_poll(usec);
+}
+
+void net::set_accept_budget(EventLoop* loop,int n)
+{
+  loop->set_accept_budget(n);
+}
+
+void net::set_auto_flush(EventLoop* loop,bool on)
+{
+  loop->set_auto_flush(on);
+}
+
+void net::set_zerocopy(EventLoop* loop,int minsize)
+{
+  loop->set_zerocopy(minsize);
+}
+
+void net::set_send_watermark(EventLoop* loop,int64_t low,int64_t high,int policy)
+{
+  loop->set_send_watermark(low,high,policy);
+}
+
+void net::event_flush(EventLoop* loop,int shard)
+{
+  loop->flush_connections(shard);
+}
+
+int net::get_msg_pool_stats(MsgPoolStats* stats,int n)
+{
+  return msg_pool_stats(stats,n);
+}
+
+int net::get_io_thread_num(EventLoop* loop)
+{
+  return loop->get_thread_num();
+}
+
+bool net::get_io_thread_load(EventLoop* loop,int tid,IoThreadLoad* load)
+{
+  IoThread* io=loop->get_thread(tid);
+  if(!io)
+    return false;
+  io->get_load_stats(load);
+  return true;
+}
+
+void net::set_placement_policy(EventLoop* loop,IPlacementPolicy* policy)
+{
+  loop->set_placement_policy(policy);
+}
+
+void net::set_rebalance(EventLoop* loop,int intervalms,int ratio,int64_t minload)
+{
+  loop->set_rebalance(intervalms,ratio,minload);
+}
+
+bool net::get_buffer_stats(EventLoop* loop,int tid,BufferStats* stats)
+{
+  IoThread* io=loop->get_thread(tid);
+  if(!io)
+    return false;
+  BufferPool* pool=io->get_buffer_pool();
+  stats->usedblocks_=pool->used_blocks();
+  stats->usedbytes_=pool->used_bytes();
+  stats->freeblocks_=pool->free_blocks();
+  stats->freebytes_=stats->freeblocks_*(int64_t)pool->block_size();
+  stats->peakbytes_=pool->peak_bytes();
+  return true;
+}
+
 void net::destroy_event_loop(EventLoop* ev)
 {
   ev->shutdown();
@@ -273,9 +648,30 @@ int net::connect(EventLoop* ev,const char* ip,int port,int64_t userdata,int32_t
   return ev->connect_to(ip,port,userdata,reconnect);
 }
 
-void net::event_process(net::EventLoop* ev)
+void net::event_process(net::EventLoop* ev,int maxwait)
 {
-  ev->loop();
+  ev->loop(maxwait);
+}
+
+void net::event_process_shard(EventLoop* ev,int shard,int maxwait)
+{
+  if(shard>=0&&shard<ev->get_shard_num())
+    ev->loop_shard(shard,maxwait);
+}
+
+int net::get_shard_num(EventLoop* ev)
+{
+  return ev->get_shard_num();
+}
+
+int net::get_connection_shard(Connection* conn)
+{
+  return conn->get_looper()->get_shard_index(conn->get_tid());
+}
+
+void net::shard_post(EventLoop* ev,int shard,Msg* msg)
+{
+  ev->post_to_shard(shard,msg);
 }
 
 void net::close_connection(net::Connection* conn)
@@ -288,6 +684,48 @@ void net::msg_send(Connection* conn,Msg* msg)
   conn->send_msg(*msg);
 }
 
+int64_t net::get_send_pending(Connection* conn)
+{
+  ClientFd* client=conn->get_client();
+  return client?client->pending_bytes():0;
+}
+
+bool net::migrate_connection(Connection* conn,int tid)
+{
+  EventLoop* looper=conn->get_looper();
+  ClientFd* client=conn->get_client();
+  if(!client||looper->has_flag(EVLOOP_IO_HANDLER)||!looper->get_thread(tid))
+    return false;
+  client->request_migrate(tid);
+  return true;
+}
+
+int net::get_connection_io_thread(Connection* conn)
+{
+  ClientFd* client=conn->get_client();
+  return client?client->get_tid():0;
+}
+
+void net::broadcast(EventLoop* ev,Connection** conns,int n,Msg* msg)
+{
+  ev->broadcast(conns,n,msg);
+}
+
+void net::group_join(EventLoop* ev,const char* group,Connection* conn)
+{
+  ev->join_group(group,conn);
+}
+
+void net::group_leave(EventLoop* ev,const char* group,Connection* conn)
+{
+  ev->leave_group(group,conn);
+}
+
+void net::group_broadcast(EventLoop* ev,const char* group,Msg* msg,int shard)
+{
+  ev->group_broadcast(shard,group,msg);
+}
+
 int64_t net::conection_user_data(Connection* conn)
 {
   return conn->get_user_data();
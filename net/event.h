@@ -3,6 +3,7 @@
 #include <vector>
 #include <string>
 #include <unordered_set>
+#include <atomic>
 #include "../base/portable.h"
 #include "../base/thread.h"
 #include "../base/readerwriterqueue.h"
@@ -21,6 +22,8 @@ namespace net
   class ThreadEventHander;
   class Poller;
   class IPollerEventHander;
+  class LogicShard;
+  class IPlacementPolicy;
 
   struct ThreadEvent
   {
@@ -37,6 +40,13 @@ namespace net
       CLOSE_CONNECTTO,
       NEW_MESSAGE,
       ENABLE_POLLOUT,
+      BROADCAST,
+      LOW_WATERMARK,
+      SHARD_MESSAGE,
+      FLUSH_SHARD,
+      MIGRATE_FD,
+      ADOPT_FD,
+      REBALANCE,
       STOP_FLASHEDFD,
       STOP_THREAD,
     }type_;
@@ -44,34 +54,70 @@ namespace net
   };
 
   typedef base::NotifyQueue<ThreadEvent> ThreadEvQueue;
-  class EventLoop:public IPollerEventHander
+  class EventLoop
   {
   public:
     EventLoop();
     ~EventLoop();
-    int initialize(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum);
+    int initialize(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum,int flags,int shards,const int* cpus);
     int serve_on_port(int port);
     int connect_to(const std::string& ip,int port,int64_t userdata,int32_t reconnect);
     int shutdown();
     IConnnectionHander* get_hander() {return hander_;}
     IDecoder* get_decoder() {return decoder_;}
     IEncoder* get_encoder() {return encoder_;}
-    IoThread* choose_thread();
+    IoThread* choose_thread(int64_t userdata=0);
+    // EVLOOP_INCOMING_CPU,the io thread pinned to cpu or else one on its numa node
+    IoThread* thread_for_cpu(int cpu);
+    void set_placement_policy(IPlacementPolicy* policy) {placement_.store(policy,std::memory_order_release);}
     IoThread* get_thread(int idx);
+    int  get_thread_num() {return threadnum_;}
     void occer_event(int tid,ThreadEvent& ev);
+    void occer_events(int tid,ThreadEvent* evs,int n);
     int  get_tid() {return 0;}
-    void loop();
+    int  get_shard_num() {return shardnum_;}
+    // event queue of a logic shard:0 main,io threads 1..threadnum_,then shards 1..
+    int  get_shard_tid(int shard) {return shard==0?0:threadnum_+shard;}
+    // connections handled on an io thread(EVLOOP_IO_HANDLER) count as shard 0
+    int  get_shard_index(int tid) {return tid>threadnum_?tid-threadnum_:0;}
+    LogicShard* get_shard(int shard) {return shards_[shard];}
+    int  choose_shard(int64_t userdata,const char* ipport);
+    void post_to_shard(int shard,Msg* msg);
+    void loop(int maxwait);
+    void loop_shard(int shard,int maxwait);
     void add_connection(Connection* con);
     void del_connection(Connection* con);
     int  get_connection_num();
     int  get_buffer_size();
     void set_buffer_size(int s);
-
-    virtual void handle_in_event();
-    virtual void handle_out_event(){}
-    virtual void handle_timer(){}
+    bool has_flag(int flag) {return (flags_&flag)!=0;}
+    int  get_busy_poll() {return busypoll_.load(std::memory_order_relaxed);}
+    void set_busy_poll(int usec) {busypoll_.store(usec,std::memory_order_relaxed);}
+    int  get_accept_budget() {return acceptbudget_.load(std::memory_order_relaxed);}
+    void set_accept_budget(int n) {acceptbudget_.store(n>0?n:1,std::memory_order_relaxed);}
+    int  get_zerocopy() {return zerocopy_.load(std::memory_order_relaxed);}
+    void set_zerocopy(int minsize) {zerocopy_.store(minsize>0?minsize:0,std::memory_order_relaxed);}
+    int64_t get_send_low() {return sendlow_.load(std::memory_order_relaxed);}
+    int64_t get_send_high() {return sendhigh_.load(std::memory_order_relaxed);}
+    int  get_slow_policy() {return slowpolicy_.load(std::memory_order_relaxed);}
+    void set_send_watermark(int64_t low,int64_t high,int policy);
+    bool is_auto_flush() {return autoflush_;}
+    void set_auto_flush(bool on);
+    void set_rebalance(int intervalms,int ratio,int64_t minload);
+    void add_dirty_connection(Connection* con);
+    // post one ENABLE_POLLOUT per dirty connection of the shard,batched per io thread
+    void flush_connections(int shard);
+    // conns must belong to the calling shard
+    void broadcast(Connection** conns,int n,Msg* msg);
+    // the shard of con is broadcasting,close con once the broadcast is posted
+    bool defer_close(Connection* con);
+    void join_group(const std::string& group,Connection* con);
+    void leave_group(const std::string& group,Connection* con);
+    void group_broadcast(int shard,const std::string& group,Msg* msg);
+  private:
+    LogicShard* shard_of(Connection* con);
+    void rebalance();
   private:
-    Poller*                           poller_;
     IConnnectionHander*               hander_;
     IConnnectionHander*               closehander_;
     IDecoder*                         decoder_;
@@ -79,10 +125,30 @@ namespace net
     IoThread**                        threads_;
     int                               threadnum_;
     ThreadEvQueue**                   evqueues_;
-    ThreadEvQueue*                    mainevqueue_;
-    std::unordered_set<Connection*>   conns_;
+    LogicShard**                      shards_;
+    int                               shardnum_;
     bool                              shutdown_;
     int                               buffersize_;
+    int                               flags_;
+    // tunables set from any thread and read by the io threads,each stands alone
+    std::atomic<int>                  busypoll_;
+    std::atomic<int>                  acceptbudget_;
+    std::atomic<int>                  zerocopy_;
+    std::atomic<int64_t>              sendlow_;
+    std::atomic<int64_t>              sendhigh_;
+    std::atomic<int>                  slowpolicy_;
+    // set from any thread,choose_thread sees the policy object fully built
+    std::atomic<IPlacementPolicy*>    placement_;
+    // core and numa node by tid,0 the thread that created the loop
+    std::vector<int>                  cpus_;
+    std::vector<int>                  nodes_;
+    // numa node by cpu,EVLOOP_INCOMING_CPU only
+    std::vector<int>                  cpunodes_;
+    std::atomic<int>                  rebalanceinterval_;
+    std::atomic<int>                  rebalanceratio_;
+    std::atomic<int64_t>              rebalancemin_;
+    int64_t                           nextrebalance_;
+    bool                              autoflush_;
   };
 
   class UUID:public base::SingleTon<UUID>
@@ -100,12 +166,14 @@ namespace net
     ThreadEventHander(EventLoop* loop,int tid);
     virtual ~ThreadEventHander(){}
     EventLoop* get_looper(){return looper_;}
-    int get_tid(){return tid_;}
+    int get_tid(){return tid_.load(std::memory_order_acquire);}
+    // a ClientFd moved to another io thread,events posted with the old tid are passed on
+    void set_tid(int tid){tid_.store(tid,std::memory_order_release);}
     void occur_event(ThreadEvent& ev);
     virtual void process_event(ThreadEvent& ev)=0;
   private:
     EventLoop* looper_;
-    int tid_;
+    std::atomic<int> tid_;
   };
 }
 
@@ -13,25 +13,134 @@
 #include "fd.h"
 #include "iothread.h"
 #include "../base/logging.h"
+#include <algorithm>
+
+static int open_idle_fd()
+{
+#ifdef __linux__
+  return open("/dev/null",O_RDONLY|O_CLOEXEC);
+#else
+  return INVALID_SOCKET;
+#endif
+}
 
 net::ezListenerFd::ezListenerFd(EventLoop* loop,IoThread* io,int fd)
   :fd_(fd),
   io_(io),
   ThreadEventHander(loop,io->get_tid())
-{}
+{
+  idlefd_=open_idle_fd();
+}
+
+net::ezListenerFd::~ezListenerFd()
+{
+#ifdef __linux__
+  if(idlefd_>=0)
+    ::close(idlefd_);
+#endif
+}
 
 void net::ezListenerFd::handle_in_event()
 {
-  struct sockaddr_in si;
-  SOCKET s=net::Accept(fd_,&si);
-  if(s==INVALID_SOCKET)
-    return;
-  IoThread* newio=get_looper()->choose_thread();
+  int budget=get_looper()->get_accept_budget();
+  for(int i=0;i<budget;++i)
+  {
+    struct sockaddr_in si;
+    SOCKET s=net::AcceptNonBlock(fd_,&si);
+    if(s==INVALID_SOCKET)
+    {
+      if(errno==EINTR||errno==ECONNABORTED)
+        continue;
+      if((errno==EMFILE||errno==ENFILE)&&shed_connection())
+        continue;
+      if(errno!=EAGAIN&&errno!=EWOULDBLOCK)
+        LOG_ERROR("accept fail:errno=%d",errno);
+      break;
+    }
+    place_fd(s);
+  }
+  flush_pending();
+}
+
+// io_uring multishot accept,the sockets come one completion each
+void net::ezListenerFd::handle_accept(int fd)
+{
+  place_fd(fd);
+  flush_pending();
+}
+
+void net::ezListenerFd::place_fd(SOCKET s)
+{
+  EventLoop* looper=get_looper();
+  IoThread* newio=nullptr;
+  if(looper->has_flag(EVLOOP_INCOMING_CPU)&&!looper->has_flag(EVLOOP_REUSEPORT))
+    newio=looper->thread_for_cpu(GetIncomingCpu(s));
+  if(!newio)
+    newio=looper->has_flag(EVLOOP_REUSEPORT)?io_:looper->choose_thread();
   assert(newio);
-  ClientFd* clifd=new ClientFd(get_looper(),newio,s,0);
+  ClientFd* clifd=new ClientFd(looper,newio,s,0);
   ThreadEvent ev;
   ev.type_=ThreadEvent::NEW_FD;
-  clifd->occur_event(ev);
+  ev.hander_=clifd;
+  // adopt on this thread directly,no need to go through the event queue
+  if(newio==io_)
+    clifd->process_event(ev);
+  else
+    pending_.push_back(ev);
+}
+
+static bool by_tid(const net::ThreadEvent& a,const net::ThreadEvent& b)
+{
+  return a.hander_->get_tid()<b.hander_->get_tid();
+}
+
+// one queue push and one wakeup per target io thread
+void net::ezListenerFd::flush_pending()
+{
+  if(pending_.empty())
+    return;
+  std::stable_sort(pending_.begin(),pending_.end(),by_tid);
+  size_t start=0;
+  for(size_t i=1;i<=pending_.size();++i)
+  {
+    int tid=pending_[start].hander_->get_tid();
+    if(i==pending_.size()||pending_[i].hander_->get_tid()!=tid)
+    {
+      get_looper()->occer_events(tid,&pending_[start],(int)(i-start));
+      start=i;
+    }
+  }
+  pending_.clear();
+}
+
+// out of descriptors:use the spare fd to accept and close the pending connection,
+// otherwise the level-triggered listener keeps firing.without a spare fd stop
+// polling the listener for a while
+bool net::ezListenerFd::shed_connection()
+{
+  int err=errno;
+  if(idlefd_>=0)
+  {
+#ifdef __linux__
+    ::close(idlefd_);
+    SOCKET s=::accept(fd_,nullptr,nullptr);
+    if(s!=INVALID_SOCKET)
+      CloseSocket(s);
+    idlefd_=open_idle_fd();
+    LOG_WARN("accept:out of fds(errno=%d),drop a connection",err);
+    return s!=INVALID_SOCKET;
+#endif
+  }
+  LOG_WARN("accept:out of fds(errno=%d),pause listening",err);
+  io_->get_poller()->reset_poll_in(fd_);
+  io_->get_poller()->add_timer(100,this);
+  return false;
+}
+
+void net::ezListenerFd::handle_timer()
+{
+  if(fd_!=INVALID_SOCKET)
+    io_->get_poller()->set_poll_in(fd_);
 }
 
 void net::ezListenerFd::process_event(ThreadEvent& ev)
@@ -41,7 +150,8 @@ void net::ezListenerFd::process_event(ThreadEvent& ev)
   case ThreadEvent::NEW_SERVICE:
     {
       io_->add_flashed_fd(this);
-      io_->get_poller()->add_fd(fd_,this);
+      if(!io_->get_poller()->add_accept_fd(fd_,this))
+        io_->get_poller()->add_fd(fd_,this);
       io_->get_poller()->set_poll_in(fd_);
     }
     break;
@@ -51,6 +161,7 @@ void net::ezListenerFd::process_event(ThreadEvent& ev)
 
 void net::ezListenerFd::close()
 {
+  io_->get_poller()->del_timer(this);
   io_->del_flashed_fd(this);
   io_->get_poller()->del_fd(fd_);
   CloseSocket(fd_);
@@ -68,45 +179,233 @@ net::ClientFd::ClientFd(EventLoop* loop,IoThread* io,int fd,int64_t userdata)
   encoder_=get_looper()->get_encoder();
   pusher_=new ezClientMessagePusher(this);
   puller_=new ezClientMessagePuller(this);
-  inbuf_=new Buffer(loop->get_buffer_size());
-  outbuf_=new Buffer(loop->get_buffer_size());
+  // blocks are taken from the io thread pool on first use,not here
+  inbuf_=new Buffer(io->get_buffer_pool(),loop->get_buffer_size());
+  outbuf_=new Buffer(io->get_buffer_pool(),loop->get_buffer_size());
   msg_init(&cachemsg_);
   cached_=false;
+  msg_init(&partial_.msg_);
+  partial_.filled_=0;
+  partial_.active_=false;
+  edge_=false;
+  completion_=false;
+  sending_=false;
+  pushed_=false;
+  notified_=false;
+  flushpending_=false;
+  zerocopy_=0;
+  queued_=0;
+  unsent_=0;
+  abovehigh_=false;
+  readpaused_=false;
+  iohander_=false;
+  delivering_=false;
+  writepending_=false;
+  closing_=false;
+  traffic_=0;
+  migrated_=0;
+  migrateto_=0;
+  owner_=io;
+  // the NEW_FD event's
+  refs_=1;
+  closed_=false;
 }
 
+// what is left once close_io ran,the thread dropping the last reference may be any
 net::ClientFd::~ClientFd()
 {
-  net::CloseSocket(fd_);
   if(pusher_) delete pusher_;
   if(puller_) delete puller_;
-  if(inbuf_)  delete inbuf_;
-  if(outbuf_) delete outbuf_;
+}
+
+// io thread,the socket and the buffers of this thread's pool go with the connection
+void net::ClientFd::close_io()
+{
+  closed_=true;
   Msg msg;
+  while(recvqueue_.try_dequeue(msg))
+    msg_free(&msg);
   while(sendqueue_.try_dequeue(msg))
     msg_free(&msg);
+  if(cached_)
+    msg_free(&cachemsg_);
+  cached_=false;
+  if(partial_.active_)
+    msg_free(&partial_.msg_);
+  partial_.active_=false;
+  // the socket goes with the blocks tcp may still read,those of a send request in
+  // flight are freed by handle_sent
+  if(sending_)
+    CloseSocket(fd_);
+  else
+  {
+    outbuf_->discard_unsent();
+    if(outbuf_->zerocopy_pending()>0)
+      new ezZeroCopyLingerFd(io_,fd_,outbuf_);
+    else
+    {
+      CloseSocket(fd_);
+      delete outbuf_;
+    }
+    outbuf_=nullptr;
+  }
+  fd_=INVALID_SOCKET;
+  delete inbuf_;
+  inbuf_=nullptr;
+}
+
+void net::ClientFd::release()
+{
+  if(refs_.fetch_sub(1,std::memory_order_acq_rel)==1)
+    delete this;
 }
 
 void net::ClientFd::handle_in_event()
 {
-  int retval=inbuf_->readfd(fd_);
-  if((retval==0)||(retval<0&&errno!=EAGAIN&&errno!=EINTR))
-  {
-    PassiveClose();
+  // the poller's recv requests read the socket,a read from here could overtake them
+  if(completion_)
     return;
-  }
-  char* rbuf=nullptr;
-  int rs=inbuf_->readable(rbuf);
-  if(rs>0)
+  if(!pause_read())
+    read_input();
+}
+
+void net::ClientFd::read_input()
+{
+  while(true)
   {
-    int rets=decoder_->decode(pusher_,rbuf,rs);
-    if(rets>0)
-      inbuf_->drain(rets);
-    else if(rets<0)
+    int retval=inbuf_->readfd(fd_);
+    if((retval==0)||(retval<0&&errno!=EAGAIN&&errno!=EINTR))
     {
       PassiveClose();
       return;
     }
+    if(retval>0)
+      count_traffic(retval,0);
+    bool drained=(retval<0&&errno==EAGAIN);
+    if(decode_input()<0)
+    {
+      PassiveClose();
+      return;
+    }
+    // level-triggered: wait next event; edge-triggered: drain to EAGAIN
+    if(!edge_||drained)
+      break;
+  }
+  if(pushed_)
+    notify_new_message();
+}
+
+// bytes to pull up for the partial frame at buf:the frame once it has all arrived,
+// nothing before that.a header cut by the block end gets a few more bytes,a decoder
+// that can't size its frames gets twice what it saw so the copying stays linear
+static size_t pullup_size(net::IDecoder* decoder,const char* buf,size_t s,size_t off)
+{
+  const size_t ezMaxFrameHeader=16;
+  int fs=decoder->frame_size(buf,s);
+  size_t need;
+  if(fs>0)
+    need=(size_t)fs>off?0:(size_t)fs;
+  else if(fs==0)
+    need=s+ezMaxFrameHeader;
+  else
+    need=s*2>s+ezMaxFrameHeader?s*2:s+ezMaxFrameHeader;
+  return need>off?off:need;
+}
+
+// decode block by block,a frame straddling blocks is pulled up into one.
+// return bytes consumed or -1 on a bad frame
+int net::ClientFd::decode_input()
+{
+  int total=0;
+  while(true)
+  {
+    char* rbuf=nullptr;
+    int rs=inbuf_->readable(rbuf);
+    if(rs<=0)
+      break;
+    int rets=decoder_->decode_buffer(pusher_,inbuf_,rbuf,rs);
+    if(rets<0)
+      return -1;
+    inbuf_->drain(rets);
+    total+=rets;
+    if(rets<rs)
+    {
+      // partial frame left,stop if it's all we have
+      if(inbuf_->off()<=(size_t)(rs-rets))
+        break;
+      size_t need=pullup_size(decoder_,rbuf+rets,rs-rets,inbuf_->off());
+      if(need<=(size_t)(rs-rets))
+        break;
+      inbuf_->pullup(need);
+    }
+  }
+  return total;
+}
+
+void net::ClientFd::notify_new_message()
+{
+  pushed_=false;
+  if(iohander_)
+  {
+    deliver_inline();
+    return;
   }
+  // the main thread hasn't drained the previous notification yet,it will see these too
+  if(notified_.exchange(true))
+    return;
+  ThreadEvent ev;
+  ev.type_=ThreadEvent::NEW_MESSAGE;
+  conn_->occur_event(ev);
+}
+
+// bytes of a recv request,still taken while paused,they are out of the socket already
+void net::ClientFd::handle_recv(const char* data,int len)
+{
+  if(closing_)
+    return;
+  if(len<=0)
+  {
+    PassiveClose();
+    return;
+  }
+  inbuf_->add(data,len);
+  count_traffic(len,0);
+  if(decode_input()<0)
+  {
+    PassiveClose();
+    return;
+  }
+  if(pushed_)
+    notify_new_message();
+  pause_read();
+}
+
+// hand the decoded msgs to the hander right here,what it sends goes out in one write
+void net::ClientFd::deliver_inline()
+{
+  delivering_=true;
+  ThreadEvent ev;
+  ev.type_=ThreadEvent::NEW_MESSAGE;
+  conn_->process_event(ev);
+  delivering_=false;
+  if(writepending_)
+  {
+    writepending_=false;
+    handle_out_event();
+  }
+}
+
+void net::ClientFd::write_inline()
+{
+  if(delivering_)
+    writepending_=true;
+  else
+    handle_out_event();
+}
+
+void net::ClientFd::close_connection()
+{
+  conn_->active_close();
 }
 
 void net::ClientFd::handle_out_event()
@@ -119,78 +418,307 @@ void net::ClientFd::handle_out_event()
     int s=outbuf_->readable(pbuf);
     if(s<=0)
     {
-      io_->get_poller()->reset_poll_out(fd_);
+      if(!edge_)
+        io_->get_poller()->reset_poll_out(fd_);
       break;
     }
     else
     {
-      int retval=outbuf_->writefd(fd_);
+      size_t before=outbuf_->off();
+      int retval=completion_?send_output():outbuf_->writefd(fd_,zerocopy_);
+      count_traffic((int64_t)(before-outbuf_->off()),0);
       if(retval<0)
       {
         PassiveClose();
         return;
       }
-      else if(retval==1||(retval==0&&!encoderet))
+      else if(retval==1)
+      {
+        // a send request in flight calls back once it is done
+        if(!edge_&&!completion_)
+          io_->get_poller()->set_poll_out(fd_);
+        break;
+      }
+      else if(retval==0&&!encoderet)
         break;
     }
   }
   if(!encoderet)
   {
-    io_->get_poller()->reset_poll_out(fd_);
+    if(!edge_)
+      io_->get_poller()->reset_poll_out(fd_);
     active_close();
     return;
   }
+  update_unsent();
+}
+
+// io_uring:send the front blocks of outbuf_ in place,they are drained by handle_sent.
+// same returns as writefd,a request in flight counts as would block
+int net::ClientFd::send_output()
+{
+  if(sending_)
+    return 1;
+  IoVec iov[16];
+  int cnt=outbuf_->peek(iov,16);
+  if(!io_->get_poller()->send(fd_,iov,cnt))
+    return -1;
+  // the request's reference,the fd and outbuf_ outlive a close until it is done
+  add_ref();
+  sending_=true;
+  return 1;
+}
+
+void net::ClientFd::handle_sent(int res)
+{
+  sending_=false;
+  if(closed_)
+  {
+    delete outbuf_;
+    outbuf_=nullptr;
+  }
+  else if(res<0)
+  {
+    if(!closing_)
+      PassiveClose();
+  }
+  else
+  {
+    outbuf_->drain(res);
+    count_traffic(res,0);
+    if(!closing_)
+      handle_out_event();
+  }
+  release();
+}
+
+// SLOW_CONSUMER_PAUSE:leave the input in the socket while the peer doesn't take what
+// it is sent,edge-triggered fds are read again from update_unsent()
+bool net::ClientFd::pause_read()
+{
+  if(readpaused_)
+    return true;
+  EventLoop* looper=get_looper();
+  int64_t high=looper->get_send_high();
+  if(looper->get_slow_policy()!=SLOW_CONSUMER_PAUSE||high<=0||pending_bytes()<high)
+    return false;
+  readpaused_=true;
+  if(!edge_)
+    io_->get_poller()->reset_poll_in(fd_);
+  return true;
+}
+
+void net::ClientFd::update_unsent()
+{
+  unsent_.store(outbuf_->off(),std::memory_order_relaxed);
+  if(!abovehigh_.load(std::memory_order_relaxed)&&!readpaused_)
+    return;
+  if(pending_bytes()>get_looper()->get_send_low())
+    return;
+  if(abovehigh_.exchange(false))
+  {
+    ThreadEvent ev;
+    ev.type_=ThreadEvent::LOW_WATERMARK;
+    conn_->occur_event(ev);
+  }
+  if(readpaused_)
+  {
+    readpaused_=false;
+    if(!edge_)
+      io_->get_poller()->set_poll_in(fd_);
+    handle_in_event();
+  }
+}
+
+// zerocopy completions arrive as EPOLLERR,anything else is a real socket error
+void net::ClientFd::handle_error_event()
+{
+  // an error polled along with the requests
+  if(completion_)
+  {
+    if(!closing_)
+      PassiveClose();
+    return;
+  }
+  bool reaped=false;
+  if(zerocopy_>0)
+  {
+    uint32_t lo=0,hi=0;
+    while(ReadZeroCopyDone(fd_,lo,hi)>0)
+    {
+      outbuf_->zerocopy_done(lo,hi);
+      reaped=true;
+    }
+  }
+  // an edge may carry both a completion and an error,read to find out.
+  // a real error is read even while paused,level-triggered EPOLLERR keeps firing
+  if(!reaped)
+    read_input();
+  else if(edge_)
+    handle_in_event();
+}
+
+void net::ClientFd::count_traffic(int64_t bytes,int msgs)
+{
+  traffic_+=bytes+(int64_t)msgs*1024;
+  io_->add_traffic(bytes,msgs);
+}
+
+bool net::ClientFd::register_fd()
+{
+  Poller* poller=io_->get_poller();
+  // zerocopy completions need the error queue polled,those sockets stay on readiness
+  completion_=zerocopy_==0&&poller->add_recv_fd(fd_,this);
+  if(completion_)
+  {
+    poller->set_poll_in(fd_);
+    return true;
+  }
+  edge_=get_looper()->has_flag(EVLOOP_EDGE_TRIGGER)&&poller->add_edge_fd(fd_,this);
+  if(!edge_)
+  {
+    if(!poller->add_fd(fd_,this))
+      return false;
+    poller->set_poll_in(fd_);
+  }
+  return true;
+}
+
+void net::ClientFd::request_migrate(int tid)
+{
+  migrateto_.store(tid,std::memory_order_relaxed);
+  ThreadEvent ev;
+  ev.type_=ThreadEvent::MIGRATE_FD;
+  add_ref();
+  occur_event(ev);
+}
+
+// keeps the rebalancer from bouncing a hot connection between two threads,now_usec counts
+// from startup so a connection that never moved isn't held back by it
+static const int64_t ezMigrateCooldown=1000000;
+
+// between two reads,with empty buffers and nothing in flight on the socket.the queues go
+// along as they are,their io thread side changes hands behind ADOPT_FD.get_tid() stays
+// the old thread until the new one adopts the fd,what reaches the old one meanwhile is
+// passed on from process_event,the event's reference keeps the fd alive until then.
+// io_uring requests can't move,cancelling them would drop what they received
+bool net::ClientFd::migrate(IoThread* io)
+{
+  int64_t now=base::now_usec();
+  if(!io||io==io_||iohander_||completion_||closing_||readpaused_||(migrated_>0&&now-migrated_<ezMigrateCooldown))
+    return false;
+  if(inbuf_->off()>0||outbuf_->off()>0||outbuf_->zerocopy_pending()>0)
+    return false;
+  io_->get_poller()->del_fd(fd_);
+  io_->del_client(this);
+  inbuf_->set_pool(io->get_buffer_pool());
+  outbuf_->set_pool(io->get_buffer_pool());
+  io_=io;
+  owner_.store(io,std::memory_order_release);
+  migrated_=now;
+  io->add_incoming();
+  ThreadEvent ev;
+  ev.type_=ThreadEvent::ADOPT_FD;
+  ev.hander_=this;
+  add_ref();
+  get_looper()->occer_event(io->get_tid(),ev);
+  return true;
 }
 
 void net::ClientFd::process_event(ThreadEvent& ev)
+{
+  // posted to a thread this fd moved away from,passed on with its reference
+  IoThread* owner=owner_.load(std::memory_order_acquire);
+  if(owner!=IoThread::current())
+  {
+    get_looper()->occer_event(owner->get_tid(),ev);
+    return;
+  }
+  if(!closed_)
+    dispatch_event(ev);
+  release();
+}
+
+void net::ClientFd::dispatch_event(ThreadEvent& ev)
 {
   switch(ev.type_)
   {
   case ThreadEvent::NEW_FD:
     {
-      Poller* poller=io_->get_poller();
-      if(!poller->add_fd(fd_,this))
+      int zcsize=get_looper()->get_zerocopy();
+      if(zcsize>0&&EnableZeroCopy(fd_))
+        zerocopy_=zcsize;
+      if(!register_fd())
       {
-        delete this;
+        close_io();
         return;
       }
-      poller->set_poll_in(fd_);
-      conn_=new Connection(get_looper(),this,get_looper()->get_tid(),userdata_);
+      EventLoop* looper=get_looper();
       char ipport[128];
       net::ToIpPort(ipport,sizeof(ipport),net::GetPeerAddr(fd_));
+      iohander_=looper->has_flag(EVLOOP_IO_HANDLER);
+      int tid=iohander_?get_tid():looper->get_shard_tid(looper->choose_shard(userdata_,ipport));
+      // the connection's reference,dropped on CLOSE_FD
+      add_ref();
+      conn_=new Connection(looper,this,tid,userdata_);
       conn_->set_ip_addr(ipport);
       ThreadEvent newev;
       newev.type_=ThreadEvent::NEW_CONNECTION;
-      conn_->occur_event(newev);
+      io_->add_client(this);
+      if(iohander_)
+        conn_->process_event(newev);
+      else
+        conn_->occur_event(newev);
+    }
+    break;
+  case ThreadEvent::MIGRATE_FD:
+    {
+      int tid=migrateto_.exchange(0);
+      if(tid>0)
+        migrate(get_looper()->get_thread(tid));
+    }
+    break;
+  case ThreadEvent::ADOPT_FD:
+    {
+      // the poller reports what arrived while the fd was on neither thread,what was
+      // queued comes with the ENABLE_POLLOUT passed on by the old thread
+      set_tid(io_->get_tid());
+      io_->add_client(this);
+      if(!register_fd())
+        PassiveClose();
     }
     break;
   case ThreadEvent::CLOSE_FD:
     {
       io_->get_poller()->del_fd(fd_);
-      Msg msg;
-      while(recvqueue_.try_dequeue(msg))
-        msg_free(&msg);
-      while(sendqueue_.try_dequeue(msg))
-        msg_free(&msg);
+      io_->del_client(this);
+      close_io();
       ThreadEvent ev;
       ev.type_=ThreadEvent::CLOSE_CONNECTION;
       conn_->occur_event(ev);
-      delete this;
+      release();
     }
     break;
   case ThreadEvent::ENABLE_POLLOUT:
-    {
-      io_->get_poller()->set_poll_out(fd_);
-      handle_out_event();
-    }
+    flush_output();
     break;
   default:
     break;
   }
 }
 
+void net::ClientFd::flush_output()
+{
+  // sends after this point post a new event
+  flushpending_.exchange(false);
+  // write right away,poll out is only armed when the socket would block
+  handle_out_event();
+}
+
 void net::ClientFd::send_msg(Msg& msg)
 {
+  // count before the io thread can pull it
+  queued_.fetch_add(msg_size(&msg),std::memory_order_relaxed);
   sendqueue_.enqueue(msg);
 }
 
@@ -201,6 +729,7 @@ bool net::ClientFd::recv_msg(Msg& msg)
 
 void net::ClientFd::active_close()
 {
+  closing_=true;
   io_->get_poller()->del_fd(fd_);
   ThreadEvent ev;
   ev.type_=ThreadEvent::CLOSE_ACTIVE;
@@ -209,6 +738,7 @@ void net::ClientFd::active_close()
 
 void net::ClientFd::PassiveClose()
 {
+  closing_=true;
   io_->get_poller()->del_fd(fd_);
   ThreadEvent ev;
   ev.type_=ThreadEvent::CLOSE_PASSIVE;
@@ -221,12 +751,85 @@ net::ezClientMessagePusher::ezClientMessagePusher(ClientFd* cli) :client_(cli)
 inline bool net::ezClientMessagePusher::push_msg(Msg* msg)
 {
   client_->recvqueue_.enqueue(*msg);
-  ThreadEvent ev;
-  ev.type_=ThreadEvent::NEW_MESSAGE;
-  client_->conn_->occur_event(ev);
+  client_->pushed_=true;
+  client_->count_traffic(0,1);
   return true;
 }
 
+net::PartialMsg* net::ezClientMessagePusher::get_partial()
+{
+  return &client_->partial_;
+}
+
+net::ezZeroCopyLingerFd::ezZeroCopyLingerFd(IoThread* io,int fd,Buffer* outbuf)
+  :io_(io)
+  ,fd_(fd)
+  ,buf_(outbuf)
+{
+  abortat_=base::now_usec()+ezLingerTimeout*1000;
+  giveupat_=abortat_+ezAbortTimeout*1000;
+  io_->add_flashed_fd(this);
+  io_->get_poller()->add_timer(ezReapInterval,this);
+}
+
+net::ezZeroCopyLingerFd::~ezZeroCopyLingerFd()
+{
+  if(fd_!=INVALID_SOCKET)
+    CloseSocket(fd_);
+  if(buf_)
+    delete buf_;
+}
+
+// true once every pending send is covered
+bool net::ezZeroCopyLingerFd::reap()
+{
+  uint32_t lo=0,hi=0;
+  while(ReadZeroCopyDone(fd_,lo,hi)>0)
+    buf_->zerocopy_done(lo,hi);
+  return buf_->zerocopy_pending()==0;
+}
+
+void net::ezZeroCopyLingerFd::handle_timer()
+{
+  if(reap())
+  {
+    finish(true);
+    return;
+  }
+  int64_t now=base::now_usec();
+  if(now>=giveupat_)
+  {
+    finish(false);
+    return;
+  }
+  if(now>=abortat_&&abortat_>0)
+  {
+    // the peer stopped reading,drop the send queue so its completions come in
+    AbortSocket(fd_);
+    abortat_=0;
+  }
+  io_->get_poller()->add_timer(ezReapInterval,this);
+}
+
+void net::ezZeroCopyLingerFd::finish(bool done)
+{
+  io_->get_poller()->del_timer(this);
+  io_->del_flashed_fd(this);
+  if(!done)
+  {
+    LOG_WARN("zerocopy:%d bytes never completed on fd %d,leaked",(int)buf_->zerocopy_pending(),fd_);
+    buf_->abandon_zerocopy();
+  }
+  delete this;
+}
+
+// shutdown,the io thread is about to stop
+void net::ezZeroCopyLingerFd::close()
+{
+  AbortSocket(fd_);
+  finish(reap());
+}
+
 net::ezConnectToFd::ezConnectToFd(EventLoop* loop,IoThread* io,int64_t userd,int32_t reconnect)
   :fd_(0)
   ,io_(io)
@@ -389,11 +992,15 @@ bool net::ezClientMessagePuller::pull_msg(Msg* msg)
   if(client_->cached_)
   {
     client_->cached_=false;
-    msg_copy(&client_->cachemsg_,msg);
-    return true;
+    // hand the held reference over,a copy would leave one behind for good
+    *msg=client_->cachemsg_;
+    msg_init(&client_->cachemsg_);
   }
-  else
-    return client_->sendqueue_.try_dequeue(*msg);
+  else if(!client_->sendqueue_.try_dequeue(*msg))
+    return false;
+  client_->queued_.fetch_sub(msg_size(msg),std::memory_order_relaxed);
+  client_->count_traffic(0,1);
+  return true;
 }
 
 void net::ezClientMessagePuller::rollback(Msg* msg)
@@ -402,6 +1009,8 @@ void net::ezClientMessagePuller::rollback(Msg* msg)
   if(!client_->cached_)
   {
     client_->cached_=true;
-    msg_copy(msg,&client_->cachemsg_);
+    client_->queued_.fetch_add(msg_size(msg),std::memory_order_relaxed);
+    client_->cachemsg_=*msg;
+    msg_init(msg);
   }
 }
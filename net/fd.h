@@ -10,11 +10,21 @@
 namespace net{
   class IoThread;
 
+  // a frame longer than what has arrived so far,filled in place as the rest comes in
+  struct PartialMsg
+  {
+    Msg      msg_;
+    uint32_t filled_;
+    bool     active_;
+  };
+
   class IMessagePusher
   {
   public:
     virtual ~IMessagePusher(){}
     virtual bool push_msg(Msg* msg)=0;
+    // per connection assembly slot for decoders,nullptr if unsupported
+    virtual PartialMsg* get_partial(){return nullptr;}
   };
 
   class IMessagePuller
@@ -40,15 +50,23 @@ namespace net{
   {
   public:
     ezListenerFd(EventLoop* loop,IoThread* io,int fd);
-    virtual ~ezListenerFd(){}
+    virtual ~ezListenerFd();
     virtual void process_event(ThreadEvent& ev);
     virtual void handle_in_event();
     virtual void handle_out_event(){}
-    virtual void handle_timer(){}
+    virtual void handle_accept(int fd);
+    virtual void handle_timer();
     virtual void close();
+  private:
+    void place_fd(SOCKET s);
+    bool shed_connection();
+    void flush_pending();
   private:
     int fd_;
     IoThread* io_;
+    // spare descriptor released to accept-and-drop when out of fds(EMFILE/ENFILE)
+    int idlefd_;
+    std::vector<ThreadEvent> pending_;
   };
 
   class ClientFd;
@@ -57,6 +75,7 @@ namespace net{
   public:
     explicit ezClientMessagePusher(ClientFd* cli);
     virtual bool push_msg(Msg* msg);
+    virtual PartialMsg* get_partial();
   private:
     ClientFd* client_;
   };
@@ -79,13 +98,53 @@ namespace net{
     virtual ~ClientFd();
     virtual void handle_in_event();
     virtual void handle_out_event();
+    virtual void handle_error_event();
+    virtual void handle_recv(const char* data,int len);
+    virtual void handle_sent(int res);
     virtual void handle_timer(){}
     virtual void process_event(ThreadEvent& ev);
     void send_msg(Msg& msg);
     bool recv_msg(Msg& msg);
+    // main thread,called before draining recvqueue_ so later pushes notify again
+    void ack_new_message() {notified_.exchange(false);}
+    // main thread,true if the caller has to post ENABLE_POLLOUT(first send since the last flush)
+    bool mark_flush_pending() {return !flushpending_.exchange(true);}
+    // io thread,write out what the main thread queued
+    void flush_output();
+    // EVLOOP_IO_HANDLER,write what the hander queued,after the callbacks if inside one
+    void write_inline();
+    // EVLOOP_IO_HANDLER shutdown
+    void close_connection();
+    // bytes queued by the main thread plus bytes encoded and not yet written
+    int64_t pending_bytes() {return queued_.load(std::memory_order_relaxed)+unsent_.load(std::memory_order_relaxed);}
+    // main thread,true if pending_bytes() just crossed the high watermark
+    bool mark_above_high() {return !abovehigh_.exchange(true);}
+    // any thread,every event posted to the fd holds a reference,so does the connection
+    // until CLOSE_FD.the fd is deleted with the last one,whichever thread drops it
+    void add_ref() {refs_.fetch_add(1,std::memory_order_relaxed);}
+    void release();
+    // any thread,have the io thread owning this fd move it to io thread tid
+    void request_migrate(int tid);
+    // io thread,hand the fd over to io.false if something is half read or unsent,the
+    // buffers can't move with blocks of this thread's pool in them
+    bool migrate(IoThread* io);
+    // io thread,traffic since the last call,bytes plus 1k per msg like the load score
+    int64_t take_traffic() {int64_t t=traffic_;traffic_=0;return t;}
     void active_close();
     void PassiveClose();
     int64_t get_user_data(){return userdata_;}
+  private:
+    bool register_fd();
+    void dispatch_event(ThreadEvent& ev);
+    void close_io();
+    void count_traffic(int64_t bytes,int msgs);
+    void read_input();
+    int  decode_input();
+    int  send_output();
+    void notify_new_message();
+    void deliver_inline();
+    bool pause_read();
+    void update_unsent();
   private:
     IDecoder*       decoder_;
     IEncoder*       encoder_;
@@ -100,12 +159,73 @@ namespace net{
     MsgQueue    recvqueue_;
     Msg       cachemsg_;
     bool        cached_;
+    PartialMsg  partial_;
     Connection* conn_;
+    bool        edge_;
+    // io_uring recv and send requests instead of readiness,see Poller::add_recv_fd
+    bool        completion_;
+    // a send request reads the front blocks of outbuf_ until handle_sent
+    bool        sending_;
+    // messages pushed during this read,at most one NEW_MESSAGE outstanding per connection
+    bool        pushed_;
+    std::atomic<bool> notified_;
+    std::atomic<bool> flushpending_;
+    // MSG_ZEROCOPY threshold for referenced payloads,0 off
+    int         zerocopy_;
+    // send backpressure,queued_ is added by the main thread and taken off as the
+    // encoder pulls,unsent_ is the size of outbuf_ after each write
+    std::atomic<int64_t> queued_;
+    std::atomic<int64_t> unsent_;
+    std::atomic<bool> abovehigh_;
+    bool        readpaused_;
+    // EVLOOP_IO_HANDLER:conn_ lives on this thread,callbacks are called in place
+    bool        iohander_;
+    bool        delivering_;
+    bool        writepending_;
+    bool        closing_;
+    int64_t     traffic_;
+    // last migration,a connection moves at most once per ezMigrateCooldown
+    int64_t     migrated_;
+    std::atomic<int> migrateto_;
+    // io_ as seen from other threads,an event reaching another io thread is passed on to it
+    std::atomic<IoThread*> owner_;
+    std::atomic<int> refs_;
+    // CLOSE_FD done,the socket and buffers are gone and late events are dropped
+    bool        closed_;
 
     friend class ezClientMessagePusher;
     friend class ezClientMessagePuller;
   };
 
+  // a closed connection whose MSG_ZEROCOPY sends are still in flight.tcp may read the
+  // pinned pages until their completions arrive,the socket and outbuf live on until then.
+  // the fd is off the poller,a hung up socket would keep firing,the error queue is
+  // polled from a timer instead
+  class ezZeroCopyLingerFd:public IPollerEventHander,public ezIFlashedFd
+  {
+  public:
+    static const int64_t ezReapInterval=20;
+    // past this the connection is reset,past ezAbortTimeout more the pages are leaked
+    static const int64_t ezLingerTimeout=10000;
+    static const int64_t ezAbortTimeout=1000;
+  public:
+    ezZeroCopyLingerFd(IoThread* io,int fd,Buffer* outbuf);
+    virtual ~ezZeroCopyLingerFd();
+    virtual void handle_in_event(){}
+    virtual void handle_out_event(){}
+    virtual void handle_timer();
+    virtual void close();
+  private:
+    bool reap();
+    void finish(bool done);
+  private:
+    IoThread* io_;
+    int       fd_;
+    Buffer*   buf_;
+    int64_t   abortat_;
+    int64_t   giveupat_;
+  };
+
   class ezConnectToFd:public IPollerEventHander,public ThreadEventHander,public ezIFlashedFd
   {
   public:
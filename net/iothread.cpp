@@ -2,13 +2,32 @@
 #include "../base/memorystream.h"
 #include "../base/eztime.h"
 #include "iothread.h"
+#include "msgpool.h"
+#include "net_interface.h"
+#include <algorithm>
+#include <functional>
+
+namespace
+{
+  thread_local net::IoThread* t_current=nullptr;
+}
 
 net::IoThread::IoThread(EventLoop* loop,int tid)
   :load_(0),
   ThreadEventHander(loop,tid)
 {
+  bytes_=0;
+  msgs_=0;
+  lastcpu_=0;
+  lastupdate_=0;
+  byterate_=0;
+  msgrate_=0;
+  cpurate_=0;
+  incoming_=0;
+  rebalanceto_=0;
+  rebalanceshare_=0;
   evqueue_=new ThreadEvQueue;
-  poller_=create_poller();
+  poller_=create_poller(loop->has_flag(EVLOOP_IO_URING));
   poller_->add_fd(evqueue_->get_fd(),this);
   poller_->set_poll_in(evqueue_->get_fd());
 }
@@ -37,21 +56,148 @@ void net::IoThread::del_flashed_fd(ezIFlashedFd* ffd)
   }
 }
 
+// close() takes the fd off the list,walk a copy
+void net::IoThread::close_flashed_fds()
+{
+  std::vector<ezIFlashedFd*> fds;
+  fds.swap(flashedfd_);
+  for(size_t i=0;i<fds.size();++i)
+    fds[i]->close();
+}
+
 void net::IoThread::handle_in_event()
 {
+  evqueue_->consume_signal();
+  dispatch_events();
+}
+
+int net::IoThread::dispatch_events()
+{
+  int n=0;
   ThreadEvent ev;
   while(evqueue_->recv(ev))
   {
     ev.hander_->process_event(ev);
+    ++n;
+  }
+  return n;
+}
+
+// cached blocks left unused for a whole interval go back to the system
+static const int64_t ezPoolTrimInterval=1000000;
+// load rates are sampled this often,an idle thread wakes up for it too
+static const int64_t ezLoadInterval=250000;
+
+// every sample weighs a quarter,a burst fades out within a couple of seconds
+static void decay(std::atomic<int64_t>& rate,int64_t sample)
+{
+  int64_t old=rate.load(std::memory_order_relaxed);
+  rate.store(old-old/4+sample/4,std::memory_order_relaxed);
+}
+
+void net::IoThread::update_load(int64_t now)
+{
+  int64_t elapsed=now-lastupdate_;
+  int64_t cpu=base::thread_cpu_usec();
+  if(elapsed>0)
+  {
+    decay(byterate_,bytes_*1000000/elapsed);
+    decay(msgrate_,msgs_*1000000/elapsed);
+    decay(cpurate_,(cpu-lastcpu_)*1000000/elapsed);
+  }
+  bytes_=0;
+  msgs_=0;
+  lastcpu_=cpu;
+  lastupdate_=now;
+  // registered with the poller by now
+  incoming_.store(0,std::memory_order_relaxed);
+}
+
+void net::IoThread::get_load_stats(IoThreadLoad* load)
+{
+  load->fds_=get_load()+incoming_.load(std::memory_order_relaxed);
+  load->bytes_=byterate_.load(std::memory_order_relaxed);
+  load->msgs_=msgrate_.load(std::memory_order_relaxed);
+  load->cpuusec_=cpurate_.load(std::memory_order_relaxed);
+}
+
+net::IoThread* net::IoThread::current()
+{
+  return t_current;
+}
+
+void net::IoThread::request_rebalance(int tid,int permille)
+{
+  rebalanceto_.store(tid,std::memory_order_relaxed);
+  rebalanceshare_.store(permille,std::memory_order_relaxed);
+  ThreadEvent ev;
+  ev.type_=ThreadEvent::REBALANCE;
+  occur_event(ev);
+}
+
+// the busiest connection within the share,moving a bigger one only moves the hot spot.
+// connections with something half read or unsent right now are passed over
+void net::IoThread::rebalance()
+{
+  IoThread* to=get_looper()->get_thread(rebalanceto_.load(std::memory_order_relaxed));
+  int64_t share=rebalanceshare_.load(std::memory_order_relaxed);
+  int64_t total=0;
+  candidates_.clear();
+  for(auto iter=clients_.begin();iter!=clients_.end();++iter)
+  {
+    int64_t traffic=(*iter)->take_traffic();
+    total+=traffic;
+    if(traffic>0)
+      candidates_.push_back(std::make_pair(traffic,*iter));
+  }
+  if(!to||to==this||total==0)
+    return;
+  std::sort(candidates_.begin(),candidates_.end(),std::greater<std::pair<int64_t,ClientFd*> >());
+  for(size_t i=0;i<candidates_.size();++i)
+  {
+    if(candidates_[i].first*1000>total*share)
+      continue;
+    if(candidates_[i].second->migrate(to))
+      break;
   }
 }
 
 void net::IoThread::run()
 {
+  t_current=this;
+  int64_t spinuntil=0;
+  int64_t nexttrim=base::now_usec()+ezPoolTrimInterval;
+  lastupdate_=base::now_usec();
+  lastcpu_=base::thread_cpu_usec();
+  int64_t nextload=lastupdate_+ezLoadInterval;
   while(!exit_)
   {
-    poller_->poll();
-    base::sleep(1);
+    // block until the next timer or fd/queue event,keep spinning while traffic is hot
+    bool spin=spinuntil>0&&base::now_usec()<spinuntil;
+    // producers only write the eventfd after prepare_wait,so the queue is drained here every round
+    bool block=!spin&&evqueue_->prepare_wait();
+    // an idle thread still wakes for the next load sample and pool trim
+    int64_t deadline=nextload<nexttrim?nextload:nexttrim;
+    int64_t wait=deadline-base::now_usec();
+    int fired=poller_->poll(block?(wait>0?(int)((wait+999)/1000):0):0);
+    evqueue_->finish_wait();
+    fired+=dispatch_events();
+    bufpool_.collect_remote();
+    int64_t now=base::now_usec();
+    int busypoll=get_looper()->get_busy_poll();
+    if(fired>0&&busypoll>0)
+      spinuntil=now+busypoll;
+    if(now>=nextload)
+    {
+      update_load(now);
+      nextload=now+ezLoadInterval;
+    }
+    if(now>=nexttrim)
+    {
+      bufpool_.trim();
+      msg_pool_trim();
+      nexttrim=now+ezPoolTrimInterval;
+    }
   }
 }
 
@@ -61,12 +207,20 @@ void net::IoThread::process_event(ThreadEvent& ev)
   {
   case ThreadEvent::STOP_FLASHEDFD:
     {
-      for(size_t i=0;i<flashedfd_.size();++i)
-        flashedfd_[i]->close();
-      flashedfd_.clear();
+      close_flashed_fds();
+      if(get_looper()->has_flag(EVLOOP_IO_HANDLER))
+      {
+        for(auto iter=clients_.begin();iter!=clients_.end();++iter)
+          (*iter)->close_connection();
+      }
     }
     break;
+  case ThreadEvent::REBALANCE:
+    rebalance();
+    break;
   case ThreadEvent::STOP_THREAD:
+    // zerocopy lingers of the connections closed since STOP_FLASHEDFD
+    close_flashed_fds();
     stop();
     break;
   default: break;
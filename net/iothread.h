@@ -6,8 +6,11 @@
 #include "poller.h"
 #include "socket.h"
 #include <vector>
+#include <unordered_set>
+#include <atomic>
 
 namespace net{
+  struct IoThreadLoad;
   class Poller;
   class ezIFlashedFd;
   class IoThread:public IPollerEventHander,public base::Threads,public ThreadEventHander
@@ -17,20 +20,52 @@ namespace net{
     virtual ~IoThread();
     ThreadEvQueue* get_ev_queue() {return evqueue_;}
     Poller* get_poller() {return poller_;}
+    BufferPool* get_buffer_pool() {return &bufpool_;}
     int get_load(){return poller_->get_load();}
+    // io thread,traffic counted into the decayed rates of get_load_stats
+    void add_traffic(int64_t bytes,int msgs) {bytes_+=bytes;msgs_+=msgs;}
+    void get_load_stats(IoThreadLoad* load);
+    // any thread,a connection was just placed here,counted as an fd until the next sample
+    void add_incoming() {incoming_.fetch_add(1,std::memory_order_relaxed);}
     void add_flashed_fd(ezIFlashedFd* ffd);
     void del_flashed_fd(ezIFlashedFd* ffd);
+    void close_flashed_fds();
+    // connections on this thread,rebalance picks from them.with EVLOOP_IO_HANDLER
+    // they are closed on STOP_FLASHEDFD
+    void add_client(ClientFd* client) {clients_.insert(client);}
+    void del_client(ClientFd* client) {clients_.erase(client);}
+    // any thread,move a connection carrying up to permille of this thread's traffic to tid
+    void request_rebalance(int tid,int permille);
+    // the io thread running the caller,nullptr on other threads
+    static IoThread* current();
     virtual void handle_in_event();
     virtual void handle_out_event(){}
     virtual void handle_timer(){}
     virtual void process_event(ThreadEvent& ev);
     virtual void run();
+  private:
+    int  dispatch_events();
+    void update_load(int64_t now);
+    void rebalance();
   private:
     int                     load_;
     Poller*               poller_;
     ThreadEvQueue*          evqueue_;
+    BufferPool              bufpool_;
+    int64_t                 bytes_;
+    int64_t                 msgs_;
+    int64_t                 lastcpu_;
+    int64_t                 lastupdate_;
+    std::atomic<int64_t>    byterate_;
+    std::atomic<int64_t>    msgrate_;
+    std::atomic<int64_t>    cpurate_;
+    std::atomic<int>        incoming_;
+    std::atomic<int>        rebalanceto_;
+    std::atomic<int>        rebalanceshare_;
+    std::vector<std::pair<int64_t,ClientFd*> > candidates_;
     // ڹرϵͳʱ׽ֺ׽
     std::vector<ezIFlashedFd*>   flashedfd_;
+    std::unordered_set<ClientFd*> clients_;
   };
 }
 #endif
\ No newline at end of file
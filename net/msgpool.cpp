@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <atomic>
+#include <algorithm>
+#include "msgpool.h"
+#include "net_interface.h"
+#include "../base/thread.h"
+#include "../base/eztime.h"
+
+/**
+*** thread cache -> central list -> malloc.a thread cache holds up to two batches per class,
+*** beyond that a batch goes to the central list,an empty cache takes a batch back from it.
+*** the central lock is taken once per batch,never per message
+**/
+namespace
+{
+  // block sizes,BigMsg header included
+  const int ezClassSize[]=
+  {
+    64,128,192,256,384,512,768,1024,1536,2048,3072,4096,
+    6144,8192,12288,16384,24576,32768,49152,65536,98304
+  };
+  const int ezNumClasses=sizeof(ezClassSize)/sizeof(ezClassSize[0]);
+  // upper bound for the memory a batch or the central list of one class may hold
+  const int ezBatchBytes=64*1024;
+  const int ezMaxBatch=32;
+  const int64_t ezCentralBytes=16*1024*1024;
+  // every io thread trims on its own tick,the central lists only once per interval
+  const int64_t ezTrimInterval=1000000;
+
+  struct FreeNode
+  {
+    FreeNode* next_;
+    FreeNode* nextbatch_;   // central list only,links the first nodes of the batches
+  };
+
+  struct CentralList
+  {
+    base::SpinLock       lock_;
+    FreeNode*            batches_;
+    int                  nbatch_;
+    int                  minbatch_;   // low water mark of nbatch_ since the last trim
+    std::atomic<int64_t> allocs_;
+    std::atomic<int64_t> frees_;
+    std::atomic<int64_t> sysallocs_;
+  };
+
+  CentralList g_central[ezNumClasses];
+  std::atomic<int64_t> g_nexttrim(0);
+
+  int batch_size(int cls)
+  {
+    int n=ezBatchBytes/ezClassSize[cls];
+    return n<2?2:(n>ezMaxBatch?ezMaxBatch:n);
+  }
+
+  int size_class(size_t size)
+  {
+    const int* end=ezClassSize+ezNumClasses;
+    const int* it=std::lower_bound(ezClassSize,end,(int)size);
+    return it==end?-1:(int)(it-ezClassSize);
+  }
+
+  struct ClassCache
+  {
+    FreeNode* head_;
+    int       count_;
+    // published to the central counters whenever a batch moves
+    int64_t   allocs_;
+    int64_t   frees_;
+  };
+
+  // set once the thread cache is destroyed,later frees from other thread_local destructors
+  // bypass it.a plain bool,still readable after the thread's destructors ran
+  thread_local bool t_cachegone=false;
+
+  class ThreadCache
+  {
+  public:
+    ThreadCache()
+    {
+      for(int i=0;i<ezNumClasses;++i)
+      {
+        ClassCache& c=classes_[i];
+        c.head_=nullptr;
+        c.count_=0;
+        c.allocs_=0;
+        c.frees_=0;
+      }
+    }
+    ~ThreadCache()
+    {
+      // the thread goes away,everything it holds goes to the central list
+      for(int i=0;i<ezNumClasses;++i)
+      {
+        while(classes_[i].count_>0)
+          release_batch(i,classes_[i].count_);
+        publish(i);
+      }
+      t_cachegone=true;
+    }
+    void* alloc(int cls)
+    {
+      ClassCache& c=classes_[cls];
+      if(!c.head_)
+        fetch_batch(cls);
+      FreeNode* node=c.head_;
+      c.head_=node->next_;
+      --c.count_;
+      ++c.allocs_;
+      return node;
+    }
+    void free(void* p,int cls)
+    {
+      ClassCache& c=classes_[cls];
+      FreeNode* node=(FreeNode*)p;
+      node->next_=c.head_;
+      c.head_=node;
+      ++c.frees_;
+      int batch=batch_size(cls);
+      if(++c.count_>2*batch)
+        release_batch(cls,batch);
+    }
+  private:
+    void publish(int cls)
+    {
+      ClassCache& c=classes_[cls];
+      CentralList& central=g_central[cls];
+      central.allocs_.fetch_add(c.allocs_,std::memory_order_relaxed);
+      central.frees_.fetch_add(c.frees_,std::memory_order_relaxed);
+      c.allocs_=0;
+      c.frees_=0;
+    }
+    void fetch_batch(int cls)
+    {
+      ClassCache& c=classes_[cls];
+      CentralList& central=g_central[cls];
+      publish(cls);
+      FreeNode* batch=nullptr;
+      central.lock_.lock();
+      if(central.batches_)
+      {
+        batch=central.batches_;
+        central.batches_=batch->nextbatch_;
+        if(--central.nbatch_<central.minbatch_)
+          central.minbatch_=central.nbatch_;
+      }
+      central.lock_.unlock();
+      int n=batch_size(cls);
+      if(!batch)
+      {
+        for(int i=0;i<n;++i)
+        {
+          FreeNode* node=(FreeNode*)::malloc(ezClassSize[cls]);
+          node->next_=batch;
+          batch=node;
+        }
+        central.sysallocs_.fetch_add(n,std::memory_order_relaxed);
+      }
+      c.head_=batch;
+      c.count_=n;
+    }
+    void release_batch(int cls,int n)
+    {
+      ClassCache& c=classes_[cls];
+      CentralList& central=g_central[cls];
+      publish(cls);
+      FreeNode* batch=c.head_;
+      FreeNode* last=batch;
+      for(int i=1;i<n;++i)
+        last=last->next_;
+      c.head_=last->next_;
+      c.count_-=n;
+      last->next_=nullptr;
+      // partial batches(thread exit) and anything past the central cap go back to malloc
+      bool keep=n==batch_size(cls);
+      if(keep)
+      {
+        central.lock_.lock();
+        keep=(int64_t)(central.nbatch_+1)*n*ezClassSize[cls]<=ezCentralBytes;
+        if(keep)
+        {
+          batch->nextbatch_=central.batches_;
+          central.batches_=batch;
+          ++central.nbatch_;
+        }
+        central.lock_.unlock();
+      }
+      if(!keep)
+      {
+        while(batch)
+        {
+          FreeNode* next=batch->next_;
+          ::free(batch);
+          batch=next;
+        }
+        central.sysallocs_.fetch_sub(n,std::memory_order_relaxed);
+      }
+    }
+  private:
+    ClassCache classes_[ezNumClasses];
+  };
+
+  thread_local ThreadCache t_cache;
+
+  // single blocks of a thread past its cache come from and go back to malloc
+  void* alloc_uncached(int cls)
+  {
+    CentralList& central=g_central[cls];
+    central.allocs_.fetch_add(1,std::memory_order_relaxed);
+    central.sysallocs_.fetch_add(1,std::memory_order_relaxed);
+    return ::malloc(ezClassSize[cls]);
+  }
+
+  void free_uncached(void* p,int cls)
+  {
+    CentralList& central=g_central[cls];
+    ::free(p);
+    central.frees_.fetch_add(1,std::memory_order_relaxed);
+    central.sysallocs_.fetch_sub(1,std::memory_order_relaxed);
+  }
+}
+
+void* net::msg_pool_alloc(size_t size,uint8_t& sclass)
+{
+  int cls=size_class(size);
+  if(cls<0)
+  {
+    sclass=ezMsgPoolNoClass;
+    return ::malloc(size);
+  }
+  sclass=(uint8_t)cls;
+  if(t_cachegone)
+    return alloc_uncached(cls);
+  return t_cache.alloc(cls);
+}
+
+void net::msg_pool_free(void* p,uint8_t sclass)
+{
+  if(sclass==ezMsgPoolNoClass)
+    ::free(p);
+  else if(t_cachegone)
+    free_uncached(p,sclass);
+  else
+    t_cache.free(p,sclass);
+}
+
+void net::msg_pool_trim()
+{
+  int64_t now=base::now_usec();
+  int64_t next=g_nexttrim.load(std::memory_order_relaxed);
+  if(now<next||!g_nexttrim.compare_exchange_strong(next,now+ezTrimInterval,std::memory_order_relaxed))
+    return;
+  // batches no thread took since the last trim are idle,they go back to malloc
+  for(int i=0;i<ezNumClasses;++i)
+  {
+    CentralList& central=g_central[i];
+    FreeNode* idle=nullptr;
+    central.lock_.lock();
+    for(int n=central.minbatch_;n>0&&central.batches_;--n)
+    {
+      FreeNode* batch=central.batches_;
+      central.batches_=batch->nextbatch_;
+      --central.nbatch_;
+      batch->nextbatch_=idle;
+      idle=batch;
+    }
+    central.minbatch_=central.nbatch_;
+    central.lock_.unlock();
+    int64_t freed=0;
+    while(idle)
+    {
+      FreeNode* node=idle;
+      idle=idle->nextbatch_;
+      while(node)
+      {
+        FreeNode* next=node->next_;
+        ::free(node);
+        node=next;
+        ++freed;
+      }
+    }
+    central.sysallocs_.fetch_sub(freed,std::memory_order_relaxed);
+  }
+}
+
+int net::msg_pool_stats(MsgPoolStats* stats,int n)
+{
+  if(n>ezNumClasses)
+    n=ezNumClasses;
+  for(int i=0;i<n;++i)
+  {
+    CentralList& central=g_central[i];
+    stats[i].size_=ezClassSize[i];
+    stats[i].allocs_=central.allocs_.load(std::memory_order_relaxed);
+    stats[i].frees_=central.frees_.load(std::memory_order_relaxed);
+    stats[i].sysblocks_=central.sysallocs_.load(std::memory_order_relaxed);
+    central.lock_.lock();
+    stats[i].central_=(int64_t)central.nbatch_*batch_size(i);
+    central.lock_.unlock();
+  }
+  return ezNumClasses;
+}
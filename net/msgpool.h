@@ -0,0 +1,21 @@
+#ifndef _MSGPOOL_H
+#define _MSGPOOL_H
+#include "../base/portable.h"
+
+namespace net
+{
+  struct MsgPoolStats;
+
+  // size class allocator for BigMsg storage.every thread caches a few blocks per class
+  // and trades whole batches with a central list,so blocks freed on the main thread go
+  // back to the io threads a batch at a time instead of through the malloc arenas
+  enum {ezMsgPoolNoClass=0xff};
+  // sclass receives the class to pass back to msg_pool_free
+  void* msg_pool_alloc(size_t size,uint8_t& sclass);
+  void  msg_pool_free(void* p,uint8_t sclass);
+  int   msg_pool_stats(MsgPoolStats* stats,int n);
+  // gives the central batches that stayed unused since the last trim back to malloc
+  void  msg_pool_trim();
+}
+
+#endif
@@ -15,6 +15,12 @@ namespace net
   public:
     virtual ~IDecoder(){}
     virtual int decode(IMessagePusher* pusher,char* buf,size_t s)=0;
+    // buf is the front of the receive buffer,a decoder may wrap payloads into msgs
+    // with buffer->slice() instead of copying them.default copies through decode()
+    virtual int decode_buffer(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s){return decode(pusher,buf,s);}
+    // length of the frame starting at buf,header included,0 while the header is incomplete,
+    // -1 unknown.a frame straddling receive blocks is pulled up to exactly this size
+    virtual int frame_size(const char* buf,size_t s){return -1;}
   };
 
   class IEncoder
@@ -22,21 +28,64 @@ namespace net
   public:
     virtual ~IEncoder(){}
     virtual bool encode(IMessagePuller* puller,Buffer* buff)=0;
+    // write msg's whole frame into frame once(msg_set_encoded) so a broadcast shares the
+    // encoded bytes,encode() must then pass encoded msgs through.false:encode per connection
+    virtual bool encode_frame(Msg* msg,Msg* frame){return false;}
   };
 
   class MsgDecoder:public IDecoder
   {
   public:
-    explicit MsgDecoder(uint16_t maxsize):maxMsgSize_(maxsize){}
+    // slicesize>0:payloads of at least slicesize bytes(and above the inline size) reference
+    // the receive block instead of being copied,the block is recycled once they are all freed.
+    // such msgs must be freed before the event loop is destroyed
+    MsgDecoder(uint16_t maxsize,int slicesize=0):maxMsgSize_(maxsize),slicesize_(slicesize){}
     virtual int decode(IMessagePusher* pusher,char* buf,size_t s);
+    virtual int decode_buffer(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s);
+    virtual int frame_size(const char* buf,size_t s);
+  private:
+    int decode_frames(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s);
   private:
     uint16_t maxMsgSize_;
+    int      slicesize_;
   };
 
   class MsgEncoder:public IEncoder
   {
   public:
+    // refsize>0:payloads of at least refsize bytes are not copied into the send buffer,
+    // it keeps the msg referenced and writev sends the payload in place
+    explicit MsgEncoder(int refsize=0):refsize_(refsize){}
     virtual bool encode(IMessagePuller* puller,Buffer* buffer);
+    virtual bool encode_frame(Msg* msg,Msg* frame);
+  private:
+    int refsize_;
+  };
+
+  // length prefixed with a varint,payloads up to maxsize bytes.frames that have not fully
+  // arrived are assembled in their final msg,slicesize as for MsgDecoder
+  class VarMsgDecoder:public IDecoder
+  {
+  public:
+    VarMsgDecoder(uint32_t maxsize,int slicesize=0):maxMsgSize_(maxsize),slicesize_(slicesize){}
+    virtual int decode(IMessagePusher* pusher,char* buf,size_t s);
+    virtual int decode_buffer(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s);
+    virtual int frame_size(const char* buf,size_t s);
+  private:
+    int decode_frames(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s);
+  private:
+    uint32_t maxMsgSize_;
+    int      slicesize_;
+  };
+
+  class VarMsgEncoder:public IEncoder
+  {
+  public:
+    explicit VarMsgEncoder(int refsize=0):refsize_(refsize){}
+    virtual bool encode(IMessagePuller* puller,Buffer* buffer);
+    virtual bool encode_frame(Msg* msg,Msg* frame);
+  private:
+    int refsize_;
   };
 
   class GameObject
@@ -58,6 +107,18 @@ namespace net
     virtual void on_open(Connection* conn)=0;
     virtual void on_close(Connection* conn)=0;
     virtual void on_data(Connection* conn,Msg* msg)=0;
+    // n msgs drained from conn's recv queue in arrival order,freed after the call
+    // (msg_move one out to keep it).default hands them to on_data one by one
+    virtual void on_data_batch(Connection* conn,Msg* msgs,int n);
+    // send backpressure(set_send_watermark),bytes is what conn has queued and not yet written.
+    // high fires once when it reaches the high mark,low once it drains back to the low mark
+    virtual void on_high_watermark(Connection* conn,int64_t bytes){}
+    virtual void on_low_watermark(Connection* conn,int64_t bytes){}
+    // logic shards(create_event_loop shards>1):pick the shard of a new connection,called on
+    // an io thread.default userdata%shards,or a hash of ipport when userdata is 0
+    virtual int  select_shard(int64_t userdata,const char* ipport,int shards);
+    // a msg posted with shard_post,on the thread driving shard
+    virtual void on_shard_message(int shard,Msg* msg){}
   };
 
   class ServerHander:public IConnnectionHander
@@ -76,15 +137,139 @@ namespace net
     virtual void on_data(Connection* conn,Msg* msg);
   };
 
+  // buffer memory of one io thread:blocks lent to connections with pending data
+  // and blocks cached in the thread's pool
+  struct BufferStats
+  {
+    int64_t usedblocks_;
+    int64_t usedbytes_;
+    int64_t freeblocks_;
+    int64_t freebytes_;
+    int64_t peakbytes_;
+  };
+
+  // one size class of the BigMsg allocator,counts are published a batch at a time
+  struct MsgPoolStats
+  {
+    int     size_;        // block size,header included
+    int64_t allocs_;
+    int64_t frees_;
+    int64_t sysblocks_;   // blocks currently taken from malloc
+    int64_t central_;     // blocks parked in the central list
+  };
+
+  // decayed per second rates of one io thread
+  struct IoThreadLoad
+  {
+    int     fds_;
+    int64_t bytes_;     // read plus written
+    int64_t msgs_;      // decoded plus encoded
+    int64_t cpuusec_;   // thread cpu time,1000000 is a busy core(busy polling counts too)
+  };
+
+  // where new connections go,called on the io thread accepting them or on the caller of
+  // connect/serve_on_port,so it must be thread safe.return an index into loads
+  class IPlacementPolicy
+  {
+  public:
+    virtual ~IPlacementPolicy(){}
+    virtual int choose_thread(const IoThreadLoad* loads,int n,int64_t userdata)=0;
+  };
+
+  enum EventLoopFlag
+  {
+    // epoll edge-triggered, client fds read/write until EAGAIN
+    EVLOOP_EDGE_TRIGGER=0x01,
+    // one SO_REUSEPORT listener per io thread,accepted fds stay on that thread
+    EVLOOP_REUSEPORT=0x02,
+    // io_uring poller,falls back to epoll if the kernel lacks support
+    EVLOOP_IO_URING=0x04,
+    // run to completion:hander callbacks run on the connection's io thread and msg_send
+    // writes from there,no hop through the main thread.a connection may then only be
+    // used inside its own callbacks,broadcast,groups and event_flush don't apply
+    EVLOOP_IO_HANDLER=0x08,
+    // with pinned io threads(create_event_loop cpus) an accepted connection goes to the
+    // thread on the cpu its packets arrive on(SO_INCOMING_CPU),else to one on that numa
+    // node.with EVLOOP_REUSEPORT each thread's listener asks for its own cpu's connections
+    EVLOOP_INCOMING_CPU=0x10,
+  };
+
+  // what happens to a connection above the high send watermark
+  enum SlowConsumerPolicy
+  {
+    // callbacks only
+    SLOW_CONSUMER_NONE=0,
+    // droppable msgs(msg_set_droppable) are freed instead of queued
+    SLOW_CONSUMER_DROP=1,
+    // close at once,unsent data is discarded
+    SLOW_CONSUMER_CLOSE=2,
+    // stop reading from the connection until it drains to the low mark
+    SLOW_CONSUMER_PAUSE=3,
+  };
+
   void         net_initialize();
-  EventLoop*   create_event_loop(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum);
+  // shards:logic threads sharing the connections,shard 0 is driven by event_process and
+  // shard i by event_process_shard(i) on a thread of its own.callbacks of a connection,
+  // and everything done with it,stay on its shard's thread.
+  // cpus:tnum+1 cores,cpus[0] for the calling thread(the one to run event_process),cpus[i]
+  // for io thread i,-1 leaves a thread unbound.a bound thread allocates from its numa node
+  EventLoop*   create_event_loop(IConnnectionHander* hander,IDecoder* decoder,IEncoder* encoder,int tnum,int flags=0,int shards=1,const int* cpus=nullptr);
   void         set_msg_buffer_size(EventLoop* loop,int size);
+  // io threads keep polling without blocking for usec after the last event,0 disable
+  void         set_busy_poll(EventLoop* loop,int usec);
+  // max connections a listener accepts per readiness event,default 64
+  void         set_accept_budget(EventLoop* loop,int n);
+  // off:msg_send only queues,messages go out on event_flush(once per tick),default on.
+  // call on shard 0's thread,switching on makes every shard flush what it has queued
+  void         set_auto_flush(EventLoop* loop,bool on);
+  // send referenced payloads(MsgEncoder refsize) of at least minsize bytes with
+  // MSG_ZEROCOPY on connections opened afterwards,0 disable(default)
+  void         set_zerocopy(EventLoop* loop,int minsize);
+  // per connection send watermarks in bytes(queued msgs plus encoded unsent data),
+  // high 0 disable(default)
+  void         set_send_watermark(EventLoop* loop,int64_t low,int64_t high,int policy=SLOW_CONSUMER_NONE);
+  void         event_flush(EventLoop* loop,int shard=0);
+  int          get_io_thread_num(EventLoop* loop);
+  // tid:1..get_io_thread_num(),false if out of range
+  bool         get_buffer_stats(EventLoop* loop,int tid,BufferStats* stats);
+  bool         get_io_thread_load(EventLoop* loop,int tid,IoThreadLoad* load);
+  // nullptr:default,the less loaded of two random io threads
+  void         set_placement_policy(EventLoop* loop,IPlacementPolicy* policy);
+  // every intervalms event_process moves one connection from the busiest io thread to the
+  // idlest,if the busiest scores above ratio percent of the idlest and at least minload
+  // more(score:cpu usec plus kb plus msgs per second).0 disable(default),not with
+  // EVLOOP_IO_HANDLER.an interval of a few seconds lets the rates settle after a move
+  void         set_rebalance(EventLoop* loop,int intervalms,int ratio=150,int64_t minload=50000);
+  // fill up to n size classes,return the number of classes
+  int          get_msg_pool_stats(MsgPoolStats* stats,int n);
+  // stop the threads driving shards 1.. first,shutdown drains their queues itself
   void         destroy_event_loop(EventLoop* ev);
   int          serve_on_port(EventLoop* ev,int port);
   int          connect(EventLoop* ev,const char* ip,int port,int64_t userdata,int32_t reconnect);
-  void         event_process(EventLoop* ev);
+  // maxwait:ms to block waiting for events,-1 until next timer or event
+  void         event_process(EventLoop* ev,int maxwait=100);
+  void         event_process_shard(EventLoop* ev,int shard,int maxwait=100);
+  int          get_shard_num(EventLoop* ev);
+  int          get_connection_shard(Connection* conn);
+  // hand msg to on_shard_message on shard's thread,msg is consumed
+  void         shard_post(EventLoop* ev,int shard,Msg* msg);
   void         close_connection(Connection* conn);
   void         msg_send(Connection* conn,Msg* msg);
+  // bytes queued on conn and not yet written to the socket
+  int64_t      get_send_pending(Connection* conn);
+  // move conn to io thread tid later on,between two reads.skipped if conn has data half
+  // read or unsent then or moved within the last second,false if it can't move at all
+  // (closed,tid out of range,EVLOOP_IO_HANDLER)
+  bool         migrate_connection(Connection* conn,int tid);
+  // io thread conn is on,0 if closed
+  int          get_connection_io_thread(Connection* conn);
+  // send msg to n connections of the calling shard,it's encoded once and the frame is
+  // shared by all of them,one event per io thread.msg is consumed like msg_send
+  void         broadcast(EventLoop* ev,Connection** conns,int n,Msg* msg);
+  // named groups,per shard.a connection leaves all its groups when it closes
+  void         group_join(EventLoop* ev,const char* group,Connection* conn);
+  void         group_leave(EventLoop* ev,const char* group,Connection* conn);
+  void         group_broadcast(EventLoop* ev,const char* group,Msg* msg,int shard=0);
   int64_t      conection_user_data(Connection* conn);
   GameObject*  get_game_object(Connection* conn);
   void         attach_game_object(Connection* conn,GameObject* obj);
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <new>
 #include "netpack.h"
+#include "msgpool.h"
 #include "../base/thread.h"
 using namespace net;
 
@@ -12,10 +13,12 @@ namespace net
   enum
   {
     more = 1,
+    encoded = 2,
+    droppable = 4,
     identity = 64,
     shared = 128
   };
-  enum {max_vsm_size = 60};
+  enum {max_vsm_size = ezMsgInlineSize};
   enum type_t
   {
     type_min = 101,
@@ -31,7 +34,8 @@ namespace net
   struct BigMsg
   {
     int8_t*          data_;
-    uint16_t         capcity_;
+    uint32_t         capcity_;
+    uint8_t          sclass_;   // msg_pool size class of this header(+payload)
     msg_free_fn*     ffn_;
     void*            hint_;
     base::AtomicNumber refcnt_;
@@ -50,8 +54,8 @@ namespace net
       struct
       {
         BigMsg*   ptr_;
-        int8_t    pad_[max_vsm_size-sizeof(BigMsg*)];
-        uint16_t  size_;
+        uint32_t  size_;
+        int8_t    pad_[max_vsm_size+sizeof(uint16_t)-sizeof(BigMsg*)-sizeof(uint32_t)];
         int8_t    type_;
         int8_t    flags_;
       }heap_;
@@ -76,12 +80,14 @@ void net::msg_init_size(Msg* msg,int size)
     inmsg->u_.stack_.flags_=0;
     inmsg->u_.stack_.size_=(uint16_t)size;
   }
-  else if(size<std::numeric_limits<uint16_t>::max())
+  else if(size>0)
   {
     inmsg->u_.heap_.type_=type_lmsg;
     inmsg->u_.heap_.flags_=0;
-    inmsg->u_.heap_.size_=(uint16_t)size;
-    inmsg->u_.heap_.ptr_=(BigMsg*)malloc(sizeof(BigMsg)+size);
+    inmsg->u_.heap_.size_=(uint32_t)size;
+    uint8_t sclass=0;
+    inmsg->u_.heap_.ptr_=(BigMsg*)msg_pool_alloc(sizeof(BigMsg)+size,sclass);
+    inmsg->u_.heap_.ptr_->sclass_=sclass;
     inmsg->u_.heap_.ptr_->data_=(int8_t*)(inmsg->u_.heap_.ptr_+1);
     inmsg->u_.heap_.ptr_->capcity_=size;
     inmsg->u_.heap_.ptr_->ffn_=nullptr;
@@ -97,7 +103,9 @@ void net::msg_init_data(Msg* msg,int8_t* data,int size,msg_free_fn* ffn,void* hi
   inmsg->u_.heap_.type_=type_lmsg;
   inmsg->u_.heap_.flags_=0;
   inmsg->u_.heap_.size_=size;
-  inmsg->u_.heap_.ptr_=(BigMsg*)malloc(sizeof(BigMsg));
+  uint8_t sclass=0;
+  inmsg->u_.heap_.ptr_=(BigMsg*)msg_pool_alloc(sizeof(BigMsg),sclass);
+  inmsg->u_.heap_.ptr_->sclass_=sclass;
   inmsg->u_.heap_.ptr_->data_=data;
   inmsg->u_.heap_.ptr_->capcity_=size;
   inmsg->u_.heap_.ptr_->ffn_=ffn;
@@ -113,6 +121,30 @@ void net::msg_init_delimiter(Msg* msg)
   inmsg->u_.stack_.size_=0;
 }
 
+void net::msg_set_encoded(Msg* msg)
+{
+  InnerMsg* inmsg=(InnerMsg*)msg;
+  inmsg->u_.stack_.flags_|=encoded;
+}
+
+bool net::msg_is_encoded(Msg* msg)
+{
+  InnerMsg* inmsg=(InnerMsg*)msg;
+  return (inmsg->u_.stack_.flags_&encoded)!=0;
+}
+
+void net::msg_set_droppable(Msg* msg)
+{
+  InnerMsg* inmsg=(InnerMsg*)msg;
+  inmsg->u_.stack_.flags_|=droppable;
+}
+
+bool net::msg_is_droppable(Msg* msg)
+{
+  InnerMsg* inmsg=(InnerMsg*)msg;
+  return (inmsg->u_.stack_.flags_&droppable)!=0;
+}
+
 bool net::msg_is_delimiter(Msg* msg)
 {
   InnerMsg* inmsg=(InnerMsg*)msg;
@@ -122,6 +154,8 @@ bool net::msg_is_delimiter(Msg* msg)
 int  net::msg_size(Msg* msg)
 {
   InnerMsg* inmsg=(InnerMsg*)msg;
+  if(inmsg->u_.stack_.type_==type_lmsg)
+    return (int)inmsg->u_.heap_.size_;
   return inmsg->u_.stack_.size_;
 }
 
@@ -186,7 +220,7 @@ void net::msg_sub_ref(Msg* msg,int ref)
     big->refcnt_.~AtomicNumber();
     if(big->ffn_)
       big->ffn_(big->data_,big->hint_);
-    free (big);
+    msg_pool_free(big,big->sclass_);
   }
 }
 
@@ -201,7 +235,7 @@ void net::msg_free(Msg* msg)
       big->refcnt_.~AtomicNumber();
       if(big->ffn_)
         big->ffn_(big->data_,big->hint_);
-      free(big);
+      msg_pool_free(big,big->sclass_);
     }
   }
   inmsg->u_.heap_.type_=0;
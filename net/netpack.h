@@ -10,6 +10,8 @@ extern "C"
 
 namespace net
 {
+  // payloads up to this size are stored inside the Msg itself
+  const int ezMsgInlineSize=60;
   struct Msg
   {
     int8_t data_[64];
@@ -22,6 +24,13 @@ namespace net
   int  msg_size(Msg* msg);
   int  msg_capcity(Msg* msg);
   bool msg_is_delimiter(Msg* msg);
+  // the msg already holds a whole frame(length prefix included),encoders write it as is
+  void msg_set_encoded(Msg* msg);
+  bool msg_is_encoded(Msg* msg);
+  // the msg may be dropped instead of queued while its connection is above the
+  // high send watermark(SLOW_CONSUMER_DROP)
+  void msg_set_droppable(Msg* msg);
+  bool msg_is_droppable(Msg* msg);
   int8_t* msg_data(Msg* msg);
 
   void msg_move(Msg* src,Msg* dst);
@@ -11,20 +11,33 @@
 #include "connection.h"
 #include "iothread.h"
 #include <algorithm>
+#ifdef NET_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#endif
+
+static int64_t wait_time(int64_t timeout,int maxwait)
+{
+  if(maxwait>=0&&(timeout<0||timeout>maxwait))
+    return maxwait;
+  return timeout;
+}
 
 bool net::SelectPoller::will_delete(const SelectFdEntry& entry)
 {
   return entry.fd_==INVALID_SOCKET;
 }
 
-void net::SelectPoller::poll()
+int net::SelectPoller::poll(int maxwait)
 {
-  int64_t timeout=timer_.invoke_timer();
+  int64_t timeout=wait_time(timer_.invoke_timer(),maxwait);
   struct timeval tm={(long)(timeout/1000),(long)(timeout%1000*1000)};
   memcpy(&urfds_,&rfds_,sizeof(fd_set));
   memcpy(&uwfds_,&wfds_,sizeof(fd_set));
   memcpy(&uefds_,&efds_,sizeof(fd_set));
-  int retval=select(maxfd_+1,&urfds_,&uwfds_,&uefds_,&tm);
+  int retval=select(maxfd_+1,&urfds_,&uwfds_,&uefds_,timeout<0?nullptr:&tm);
   if(retval>0)
   {
     for(size_t j=0;j<fdarray_.size();++j)
@@ -51,6 +64,7 @@ void net::SelectPoller::poll()
     fdarray_.erase(std::remove_if(fdarray_.begin(),fdarray_.end(),SelectPoller::will_delete),fdarray_.end());
     willdelfd_ = false;
   }
+  return retval>0?retval:0;
 }
 
 net::SelectPoller::SelectPoller()
@@ -141,55 +155,86 @@ void net::SelectPoller::del_timer(IPollerEventHander* hander)
 }
 
 #ifdef __linux__
-net::EpollPoller::EpollPoller():willdelfd_(false)
+net::EpollPoller::EpollPoller()
 {
   epollfd_=epoll_create1(0);
+  // size the table for the whole fd limit up front,connection churn never allocates
+  struct rlimit rl;
+  size_t n=1024;
+  if(getrlimit(RLIMIT_NOFILE,&rl)==0&&rl.rlim_cur!=RLIM_INFINITY)
+    n=std::max(n,std::min((size_t)rl.rlim_cur,(size_t)65536));
+  EpollFdEntry empty={nullptr,0,0};
+  fdarray_.assign(n,empty);
 }
 
 net::EpollPoller::~EpollPoller()
 {
   close(epollfd_);
-  // fdarray_ clear
 }
 
 bool net::EpollPoller::add_fd(int fd,IPollerEventHander* hander)
+{
+  return add_entry(fd,hander,EPOLLERR|EPOLLHUP);
+}
+
+bool net::EpollPoller::add_edge_fd(int fd,IPollerEventHander* hander)
+{
+  return add_entry(fd,hander,EPOLLERR|EPOLLHUP|EPOLLIN|EPOLLOUT|EPOLLET);
+}
+
+bool net::EpollPoller::add_entry(int fd,IPollerEventHander* hander,int event)
 {
   assert(fd>0);
-  if(fdarray_.size()<=fd)
-    fdarray_.resize(fd*2+1);
-  if(fdarray_[fd])
-    delete fdarray_[fd];
-  EpollFdEntry* entry=new EpollFdEntry;
-  entry->fd_=fd;
-  entry->hander_=hander;
-  entry->event_=0;
-  entry->event_|=EPOLLERR;
-  entry->event_|=EPOLLHUP;
-  fdarray_[fd]=entry;
+  if(fdarray_.size()<=(size_t)fd)
+  {
+    EpollFdEntry empty={nullptr,0,0};
+    fdarray_.resize(fd*2+1,empty);
+  }
+  EpollFdEntry& entry=fdarray_[fd];
+  entry.hander_=hander;
+  entry.gen_++;
+  entry.event_=event;
 
   struct epoll_event ee;
-  ee.events=entry->event_;
-  ee.data.ptr=entry;
+  ee.events=entry.event_;
+  ee.data.u64=((uint64_t)entry.gen_<<32)|(uint32_t)fd;
   int rc=epoll_ctl(epollfd_,EPOLL_CTL_ADD,fd,&ee);
   assert(rc!=-1);
   load_.Inc();
   return true;
 }
 
+net::EpollPoller::EpollFdEntry* net::EpollPoller::get_entry(int fd)
+{
+  assert(fd>0&&(size_t)fd<fdarray_.size());
+  if(fd<=0||(size_t)fd>=fdarray_.size())
+    return nullptr;
+  EpollFdEntry* entry=&fdarray_[fd];
+  if(!entry->hander_)
+    return nullptr;
+  return entry;
+}
+
+void net::EpollPoller::modify(int fd,EpollFdEntry* entry)
+{
+  struct epoll_event ee;
+  ee.events=entry->event_;
+  ee.data.u64=((uint64_t)entry->gen_<<32)|(uint32_t)fd;
+  int rc=epoll_ctl(epollfd_,EPOLL_CTL_MOD,fd,&ee);
+  assert(rc!=-1);
+}
+
 void net::EpollPoller::del_fd(int fd)
 {
-  assert(fd>0&&fd<fdarray_.size());
-  if(fd<=0||fd>=fdarray_.size())
+  EpollFdEntry* entry=get_entry(fd);
+  if(!entry)
     return;
-  EpollFdEntry* entry=fdarray_[fd];
-  if(!entry||entry->fd_==INVALID_SOCKET)
-    return;
-  willdelfd_=true;
-  delarray_.push_back(entry->fd_);
-  entry->fd_=INVALID_SOCKET;
+  // events already returned by this epoll_wait carry the old generation and are dropped
+  entry->hander_=nullptr;
+  entry->gen_++;
   struct epoll_event ee;
   ee.events=entry->event_;
-  ee.data.ptr=entry;
+  ee.data.u64=0;
   int rc=epoll_ctl(epollfd_,EPOLL_CTL_DEL,fd,&ee);
   assert(rc!=-1);
   load_.Dec();
@@ -197,170 +242,952 @@ void net::EpollPoller::del_fd(int fd)
 
 void net::EpollPoller::set_poll_in(int fd)
 {
-  assert(fd>0&&fd<fdarray_.size());
-  if(fd<=0||fd>=fdarray_.size())
-    return;
-  EpollFdEntry* entry=fdarray_[fd];
-  if(!entry||entry->fd_==INVALID_SOCKET)
+  EpollFdEntry* entry=get_entry(fd);
+  if(!entry)
     return;
   if(entry->event_&EPOLLIN)
     return;
   entry->event_|=EPOLLIN;
-  struct epoll_event ee;
-  ee.events=entry->event_;
-  ee.data.ptr=entry;
-  int rc=epoll_ctl(epollfd_,EPOLL_CTL_MOD,fd,&ee);
-  assert(rc!=-1);
+  modify(fd,entry);
 }
 
 void net::EpollPoller::reset_poll_in( int fd )
 {
-  assert(fd>0&&fd<fdarray_.size());
-  if(fd<=0||fd>=fdarray_.size())
+  EpollFdEntry* entry=get_entry(fd);
+  if(!entry)
     return;
-  EpollFdEntry* entry=fdarray_[fd];
-  if(!entry||entry->fd_==INVALID_SOCKET)
+  if(entry->event_&EPOLLET)
     return;
   if(entry->event_&EPOLLIN)
   {
     entry->event_&=(~EPOLLIN);
-    struct epoll_event ee;
-    ee.events=entry->event_;
-    ee.data.ptr=entry;
-    int rc=epoll_ctl(epollfd_,EPOLL_CTL_MOD,fd,&ee);
-    assert(rc!=-1);
+    modify(fd,entry);
   }
 }
 
 void net::EpollPoller::set_poll_out( int fd )
 {
-  assert(fd>0&&fd<fdarray_.size());
-  if(fd<=0||fd>=fdarray_.size())
-    return;
-  EpollFdEntry* entry=fdarray_[fd];
-  if(!entry||entry->fd_==INVALID_SOCKET)
+  EpollFdEntry* entry=get_entry(fd);
+  if(!entry)
     return;
   if(entry->event_&EPOLLOUT)
     return;
   entry->event_|=EPOLLOUT;
-  struct epoll_event ee;
-  ee.events=entry->event_;
-  ee.data.ptr=entry;
-  int rc=epoll_ctl(epollfd_,EPOLL_CTL_MOD,fd,&ee);
-  assert(rc!=-1);
+  modify(fd,entry);
 }
 
 void net::EpollPoller::reset_poll_out( int fd )
 {
-  assert(fd>0&&fd<fdarray_.size());
-  if(fd<=0||fd>=fdarray_.size())
+  EpollFdEntry* entry=get_entry(fd);
+  if(!entry)
     return;
-  EpollFdEntry* entry=fdarray_[fd];
-  if(!entry||entry->fd_==INVALID_SOCKET)
+  if(entry->event_&EPOLLET)
     return;
   if(entry->event_&EPOLLOUT)
   {
     entry->event_&=(~EPOLLOUT);
-    struct epoll_event ee;
-    ee.events=entry->event_;
-    ee.data.ptr=entry;
-    int rc=epoll_ctl(epollfd_,EPOLL_CTL_MOD,fd,&ee);
-    assert(rc!=-1);
+    modify(fd,entry);
   }
 }
 
-void net::EpollPoller::poll()
+bool net::EpollPoller::is_live(int fd,uint32_t gen)
 {
-  int timeout=(int)(timer_.invoke_timer());
+  return fdarray_[fd].gen_==gen&&fdarray_[fd].hander_;
+}
+
+int net::EpollPoller::poll(int maxwait)
+{
+  int timeout=(int)wait_time(timer_.invoke_timer(),maxwait);
   int retval=0;
-  retval = epoll_wait(epollfd_,epollevents_,sizeof(epollevents_)/sizeof(struct epoll_event),timeout>0?timeout:100);
-  if(retval<0&&errno!=EINTR)
+  retval = epoll_wait(epollfd_,epollevents_,sizeof(epollevents_)/sizeof(struct epoll_event),timeout);
+  if(retval<0)
   {
-    char err[256];
-    strerror_r(errno,err,sizeof(err));
-    LOG_INFO("epoll_wait return errno=%d,'%s'",errno,err);
-    return;
+    if(errno!=EINTR)
+    {
+      char err[256];
+      strerror_r(errno,err,sizeof(err));
+      LOG_INFO("epoll_wait return errno=%d,'%s'",errno,err);
+    }
+    return 0;
   }
   for (int j=0;j<retval;j++) 
   {
     struct epoll_event *e = &epollevents_[j];
-    EpollFdEntry* entry=(EpollFdEntry*)(e->data.ptr);
-    if(entry->fd_==INVALID_SOCKET)
+    int fd=(int)(uint32_t)e->data.u64;
+    uint32_t gen=(uint32_t)(e->data.u64>>32);
+    // fdarray_ may grow inside a hander,look the entry up by index each time
+    if(!is_live(fd,gen))
       continue;
-    if(e->events&(EPOLLERR|EPOLLHUP))
-      entry->hander_->handle_in_event();
-    if(entry->fd_==INVALID_SOCKET)
+    IPollerEventHander* hander=fdarray_[fd].hander_;
+    if(e->events&EPOLLERR)
+      hander->handle_error_event();
+    else if(e->events&EPOLLHUP)
+      hander->handle_in_event();
+    if(!is_live(fd,gen))
       continue;
     if(e->events&EPOLLOUT)
-      entry->hander_->handle_out_event();
-    if(entry->fd_==INVALID_SOCKET)
+      hander->handle_out_event();
+    if(!is_live(fd,gen))
       continue;
     if(e->events&EPOLLIN)
-      entry->hander_->handle_in_event();
+      hander->handle_in_event();
   }
-  if(willdelfd_)
+  return retval;
+}
+
+void net::EpollPoller::add_timer(int64_t timeout,IPollerEventHander* hander)
+{
+  timer_.add_timer(hander,timeout);
+}
+
+void net::EpollPoller::del_timer(IPollerEventHander* hander)
+{
+  timer_.del_timer(hander);
+}
+#endif
+
+#ifdef NET_HAVE_IO_URING
+net::UringPoller::UringPoller()
+  :canrecv_(false),bufring_(nullptr),bufs_(nullptr),buftail_(0),
+  ringfd_(-1),sqring_(MAP_FAILED),sqringsz_(0),cqring_(MAP_FAILED),cqringsz_(0),
+  sqes_((io_uring_sqe*)MAP_FAILED),sqessz_(0),sqlocal_(0)
+{
+}
+
+net::UringPoller::~UringPoller()
+{
+  // closing the ring ends the requests still using the buffers below
+  if(ringfd_>=0)
+    close(ringfd_);
+  if(sqes_!=MAP_FAILED)
+    munmap(sqes_,sqessz_);
+  if(cqring_!=MAP_FAILED&&cqring_!=sqring_)
+    munmap(cqring_,cqringsz_);
+  if(sqring_!=MAP_FAILED)
+    munmap(sqring_,sqringsz_);
+  if(bufring_)
+    munmap(bufring_,ezRecvBufs*sizeof(struct io_uring_buf));
+  if(bufs_)
+    munmap(bufs_,(size_t)ezRecvBufs*ezRecvBufSize);
+  // handers of sends still in flight aren't called back anymore
+  for(size_t i=0;i<fdarray_.size();++i)
+  {
+    if(fdarray_[i].send_)
+      delete fdarray_[i].send_;
+  }
+  for(size_t i=0;i<orphansends_.size();++i)
+    delete orphansends_[i];
+  for(size_t i=0;i<freesends_.size();++i)
+    delete freesends_[i];
+}
+
+static bool has_op(const struct io_uring_probe* probe,int op)
+{
+  return op<=probe->last_op&&(probe->ops[op].flags&IO_URING_OP_SUPPORTED)!=0;
+}
+
+bool net::UringPoller::initialize(unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p,0,sizeof(p));
+  ringfd_=(int)syscall(__NR_io_uring_setup,entries,&p);
+  if(ringfd_<0)
+    return false;
+  // ext arg(5.11) for the wait timeout
+  unsigned need=IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG;
+  if((p.features&need)!=need)
+    return false;
+  sqringsz_=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  cqringsz_=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features&IORING_FEAT_SINGLE_MMAP)
+  {
+    if(cqringsz_>sqringsz_)
+      sqringsz_=cqringsz_;
+    cqringsz_=sqringsz_;
+  }
+  sqring_=mmap(nullptr,sqringsz_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd_,IORING_OFF_SQ_RING);
+  if(sqring_==MAP_FAILED)
+    return false;
+  if(p.features&IORING_FEAT_SINGLE_MMAP)
+    cqring_=sqring_;
+  else
+    cqring_=mmap(nullptr,cqringsz_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd_,IORING_OFF_CQ_RING);
+  if(cqring_==MAP_FAILED)
+    return false;
+  sqessz_=p.sq_entries*sizeof(struct io_uring_sqe);
+  sqes_=(io_uring_sqe*)mmap(nullptr,sqessz_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd_,IORING_OFF_SQES);
+  if(sqes_==MAP_FAILED)
+    return false;
+  char* sq=(char*)sqring_;
+  sqhead_=(unsigned*)(sq+p.sq_off.head);
+  sqtail_=(unsigned*)(sq+p.sq_off.tail);
+  sqflags_=(unsigned*)(sq+p.sq_off.flags);
+  sqarray_=(unsigned*)(sq+p.sq_off.array);
+  sqmask_=*(unsigned*)(sq+p.sq_off.ring_mask);
+  sqentries_=p.sq_entries;
+  sqlocal_=*sqtail_;
+  char* cq=(char*)cqring_;
+  cqhead_=(unsigned*)(cq+p.cq_off.head);
+  cqtail_=(unsigned*)(cq+p.cq_off.tail);
+  cqmask_=*(unsigned*)(cq+p.cq_off.ring_mask);
+  cqes_=(io_uring_cqe*)(cq+p.cq_off.cqes);
+  // multishot flags can't be probed,the opcodes that came with them stand in:
+  // IORING_OP_SOCKET with multishot accept and buffer rings(5.19,multishot poll is
+  // older),IORING_OP_SEND_ZC with multishot recv(6.0)
+  std::vector<char> probebuf(sizeof(struct io_uring_probe)+IORING_OP_LAST*sizeof(struct io_uring_probe_op),0);
+  struct io_uring_probe* probe=(struct io_uring_probe*)&probebuf[0];
+  if(syscall(__NR_io_uring_register,ringfd_,IORING_REGISTER_PROBE,probe,IORING_OP_LAST)<0)
+    return false;
+  if(!has_op(probe,IORING_OP_POLL_ADD)||!has_op(probe,IORING_OP_POLL_REMOVE)||
+    !has_op(probe,IORING_OP_ASYNC_CANCEL)||!has_op(probe,IORING_OP_ACCEPT)||
+    !has_op(probe,IORING_OP_SENDMSG)||!has_op(probe,IORING_OP_SOCKET))
+    return false;
+  canrecv_=has_op(probe,IORING_OP_SEND_ZC)&&setup_buf_ring();
+  if(!canrecv_)
+    LOG_INFO("io_uring multishot recv not supported,connections are polled");
+  return true;
+}
+
+// one buffer group shared by every recv of the ring,a buffer goes back right after
+// its data is handed over
+bool net::UringPoller::setup_buf_ring()
+{
+  size_t ringsz=ezRecvBufs*sizeof(struct io_uring_buf);
+  size_t bufsz=(size_t)ezRecvBufs*ezRecvBufSize;
+  void* ring=mmap(nullptr,ringsz,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if(ring==MAP_FAILED)
+    return false;
+  void* bufs=mmap(nullptr,bufsz,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if(bufs==MAP_FAILED)
+  {
+    munmap(ring,ringsz);
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg,0,sizeof(reg));
+  reg.ring_addr=(uint64_t)(uintptr_t)ring;
+  reg.ring_entries=ezRecvBufs;
+  reg.bgid=0;
+  if(syscall(__NR_io_uring_register,ringfd_,IORING_REGISTER_PBUF_RING,&reg,1)<0)
+  {
+    munmap(bufs,bufsz);
+    munmap(ring,ringsz);
+    return false;
+  }
+  bufring_=(io_uring_buf_ring*)ring;
+  bufs_=(char*)bufs;
+  for(unsigned i=0;i<ezRecvBufs;++i)
+    recycle_buf(i);
+  return true;
+}
+
+void net::UringPoller::recycle_buf(unsigned bid)
+{
+  // not bufring_->bufs,the header's flex array wrapper moves it off 0 in C++
+  struct io_uring_buf* buf=(struct io_uring_buf*)bufring_+(buftail_&(ezRecvBufs-1));
+  buf->addr=(uint64_t)(uintptr_t)(bufs_+(size_t)bid*ezRecvBufSize);
+  buf->len=ezRecvBufSize;
+  buf->bid=(uint16_t)bid;
+  ++buftail_;
+  __atomic_store_n(&bufring_->tail,buftail_,__ATOMIC_RELEASE);
+}
+
+net::UringPoller::UringSend* net::UringPoller::alloc_send()
+{
+  if(freesends_.empty())
+    return new UringSend;
+  UringSend* send=freesends_.back();
+  freesends_.pop_back();
+  return send;
+}
+
+void net::UringPoller::free_send(UringSend* send)
+{
+  if(freesends_.size()<ezMaxFreeSends)
+    freesends_.push_back(send);
+  else
+    delete send;
+}
+
+bool net::UringPoller::add_fd(int fd,IPollerEventHander* hander)
+{
+  return add_entry(fd,hander,0,false);
+}
+
+bool net::UringPoller::add_edge_fd(int fd,IPollerEventHander* hander)
+{
+  return add_entry(fd,hander,POLLIN|POLLOUT,true);
+}
+
+bool net::UringPoller::add_accept_fd(int fd,IPollerEventHander* hander)
+{
+  return add_entry(fd,hander,0,false,URING_ACCEPT);
+}
+
+bool net::UringPoller::add_recv_fd(int fd,IPollerEventHander* hander)
+{
+  if(!canrecv_)
+    return false;
+  return add_entry(fd,hander,0,false,URING_RECV);
+}
+
+bool net::UringPoller::add_entry(int fd,IPollerEventHander* hander,int event,bool edge,int kind/*=URING_POLL*/)
+{
+  assert(fd>0&&fd<(1<<24));
+  if(fdarray_.size()<=(size_t)fd)
+  {
+    UringFdEntry empty={nullptr,0,0,0,false,false,false,URING_POLL,0,false,nullptr};
+    fdarray_.resize(fd*2+1,empty);
+  }
+  UringFdEntry& entry=fdarray_[fd];
+  if(entry.armed_)
+    cancel(make_tag(entry.seq_,URING_POLL,fd));
+  cancel_op(fd);
+  drop_send(fd);
+  entry.hander_=hander;
+  entry.gen_++;
+  entry.seq_++;
+  entry.event_=event;
+  entry.edge_=edge;
+  entry.armed_=false;
+  entry.kind_=kind;
+  enqueue(fd);
+  load_.Inc();
+  return true;
+}
+
+net::UringPoller::UringFdEntry* net::UringPoller::get_entry(int fd)
+{
+  assert(fd>0&&(size_t)fd<fdarray_.size());
+  if(fd<=0||(size_t)fd>=fdarray_.size())
+    return nullptr;
+  UringFdEntry* entry=&fdarray_[fd];
+  if(!entry->hander_)
+    return nullptr;
+  return entry;
+}
+
+void net::UringPoller::del_fd(int fd)
+{
+  UringFdEntry* entry=get_entry(fd);
+  if(!entry)
+    return;
+  // the requests hold their own file reference,so the fd may be closed before
+  // the cancel reaches the kernel,their late cqes no longer match seq_ or gen_
+  if(entry->armed_)
+    cancel(make_tag(entry->seq_,URING_POLL,fd));
+  cancel_op(fd);
+  drop_send(fd);
+  entry->hander_=nullptr;
+  entry->gen_++;
+  entry->seq_++;
+  entry->armed_=false;
+  load_.Dec();
+}
+
+void net::UringPoller::set_poll_in(int fd)
+{
+  UringFdEntry* entry=get_entry(fd);
+  if(!entry||(entry->event_&POLLIN))
+    return;
+  entry->event_|=POLLIN;
+  // the accept or recv request is all poll in stands for
+  if(entry->kind_!=URING_POLL)
+    enqueue(fd);
+  else
+    rearm(fd);
+}
+
+void net::UringPoller::reset_poll_in(int fd)
+{
+  UringFdEntry* entry=get_entry(fd);
+  if(!entry||entry->edge_||!(entry->event_&POLLIN))
+    return;
+  entry->event_&=(~POLLIN);
+  if(entry->kind_!=URING_POLL)
+    cancel_op(fd);
+  else
+    rearm(fd);
+}
+
+void net::UringPoller::set_poll_out(int fd)
+{
+  UringFdEntry* entry=get_entry(fd);
+  if(!entry||(entry->event_&POLLOUT))
+    return;
+  entry->event_|=POLLOUT;
+  rearm(fd);
+}
+
+void net::UringPoller::reset_poll_out(int fd)
+{
+  UringFdEntry* entry=get_entry(fd);
+  if(!entry||entry->edge_||!(entry->event_&POLLOUT))
+    return;
+  entry->event_&=(~POLLOUT);
+  rearm(fd);
+}
+
+void net::UringPoller::enqueue(int fd)
+{
+  UringFdEntry& entry=fdarray_[fd];
+  if(!entry.queued_)
+  {
+    entry.queued_=true;
+    rearmarray_.push_back(fd);
+  }
+}
+
+void net::UringPoller::rearm(int fd)
+{
+  UringFdEntry& entry=fdarray_[fd];
+  if(entry.armed_)
+  {
+    cancel(make_tag(entry.seq_,URING_POLL,fd));
+    entry.seq_++;
+    entry.armed_=false;
+  }
+  enqueue(fd);
+}
+
+bool net::UringPoller::arm(int fd)
+{
+  UringFdEntry& entry=fdarray_[fd];
+  if(!entry.hander_)
+  {
+    entry.queued_=false;
+    return true;
+  }
+  if(!arm_op(fd))
+    return false;
+  // next to a request polls only wait for poll out,errors come with its completions
+  int event=entry.kind_==URING_POLL?entry.event_:(entry.event_&~POLLIN);
+  if(entry.armed_||(entry.kind_!=URING_POLL&&event==0))
+  {
+    entry.queued_=false;
+    return true;
+  }
+  io_uring_sqe* sqe=get_sqe();
+  if(!sqe)
+    return false;
+  entry.seq_++;
+  sqe->opcode=IORING_OP_POLL_ADD;
+  sqe->fd=fd;
+  // err and hup are always reported,even with an empty mask
+  sqe->poll32_events=entry.edge_?(event|EPOLLET):event;
+  sqe->len=entry.edge_?IORING_POLL_ADD_MULTI:0;
+  sqe->user_data=make_tag(entry.seq_,URING_POLL,fd);
+  entry.armed_=true;
+  entry.queued_=false;
+  return true;
+}
+
+// multishot accept or recv for poll in,it stays until cancelled or the kernel ends it
+bool net::UringPoller::arm_op(int fd)
+{
+  UringFdEntry& entry=fdarray_[fd];
+  if(entry.kind_==URING_POLL||entry.oparmed_||!(entry.event_&POLLIN))
+    return true;
+  io_uring_sqe* sqe=get_sqe();
+  if(!sqe)
+    return false;
+  entry.opseq_++;
+  sqe->fd=fd;
+  if(entry.kind_==URING_RECV)
+  {
+    sqe->opcode=IORING_OP_RECV;
+    sqe->ioprio=IORING_RECV_MULTISHOT;
+    sqe->flags=IOSQE_BUFFER_SELECT;
+    sqe->buf_group=0;
+  }
+  else
+  {
+    sqe->opcode=IORING_OP_ACCEPT;
+    sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags=SOCK_NONBLOCK|SOCK_CLOEXEC;
+  }
+  sqe->user_data=make_tag(op_tag(entry),entry.kind_,fd);
+  entry.oparmed_=true;
+  return true;
+}
+
+void net::UringPoller::cancel(uint64_t tag)
+{
+  io_uring_sqe* sqe=get_sqe();
+  if(!sqe)
+  {
+    LOG_INFO("io_uring submission ring full,request %llx not cancelled",(unsigned long long)tag);
+    return;
+  }
+  sqe->opcode=((tag>>24)&0xff)==URING_POLL?IORING_OP_POLL_REMOVE:IORING_OP_ASYNC_CANCEL;
+  sqe->fd=-1;
+  sqe->addr=tag;
+  sqe->user_data=0;
+}
+
+void net::UringPoller::cancel_op(int fd)
+{
+  UringFdEntry& entry=fdarray_[fd];
+  if(!entry.oparmed_)
+    return;
+  cancel(make_tag(op_tag(entry),entry.kind_,fd));
+  entry.opseq_++;
+  entry.oparmed_=false;
+}
+
+// the fd is closed next,a send still in the ring would go to whatever reuses the number.
+// one the kernel has picked up keeps the socket and sends on,the hander hears of its cqe
+void net::UringPoller::drop_send(int fd)
+{
+  UringFdEntry& entry=fdarray_[fd];
+  if(!entry.send_)
+    return;
+  if(sqlocal_!=*sqtail_)
+    enter(0,false);
+  orphansends_.push_back(entry.send_);
+  entry.send_=nullptr;
+}
+
+bool net::UringPoller::send(int fd,const IoVec* iov,int cnt)
+{
+  UringFdEntry* entry=get_entry(fd);
+  if(!entry||entry->kind_!=URING_RECV||entry->send_||cnt<=0)
+    return false;
+  if(cnt>ezSendIovs)
+    cnt=ezSendIovs;
+  UringSend* send=alloc_send();
+  memset(&send->msg_,0,sizeof(send->msg_));
+  for(int i=0;i<cnt;++i)
+    send->iov_[i]=iov[i];
+  send->msg_.msg_iov=send->iov_;
+  send->msg_.msg_iovlen=cnt;
+  send->hander_=entry->hander_;
+  if(!submit_send(fd,send,0))
+  {
+    free_send(send);
+    return false;
+  }
+  entry->send_=send;
+  return true;
+}
+
+bool net::UringPoller::submit_send(int fd,UringSend* send,unsigned flags)
+{
+  io_uring_sqe* sqe=get_sqe();
+  if(!sqe)
+    return false;
+  send->tag_=make_tag(fdarray_[fd].gen_,URING_SEND,fd);
+  sqe->opcode=IORING_OP_SENDMSG;
+  sqe->fd=fd;
+  sqe->addr=(uint64_t)(uintptr_t)&send->msg_;
+  sqe->len=1;
+  sqe->msg_flags=MSG_NOSIGNAL;
+  sqe->ioprio=flags;
+  sqe->user_data=send->tag_;
+  return true;
+}
+
+io_uring_sqe* net::UringPoller::get_sqe()
+{
+  if(sqlocal_-__atomic_load_n(sqhead_,__ATOMIC_ACQUIRE)>=sqentries_)
+  {
+    enter(0,false);
+    if(sqlocal_-__atomic_load_n(sqhead_,__ATOMIC_ACQUIRE)>=sqentries_)
+      return nullptr;
+  }
+  unsigned idx=sqlocal_&sqmask_;
+  io_uring_sqe* sqe=&sqes_[idx];
+  memset(sqe,0,sizeof(*sqe));
+  sqarray_[idx]=idx;
+  sqlocal_++;
+  return sqe;
+}
+
+int net::UringPoller::enter(int64_t timeout,bool wait)
+{
+  unsigned tosubmit=sqlocal_-__atomic_load_n(sqhead_,__ATOMIC_ACQUIRE);
+  __atomic_store_n(sqtail_,sqlocal_,__ATOMIC_RELEASE);
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg,0,sizeof(arg));
+  if(wait&&timeout>=0)
+  {
+    ts.tv_sec=timeout/1000;
+    ts.tv_nsec=timeout%1000*1000000;
+    arg.ts=(uint64_t)(uintptr_t)&ts;
+  }
+  int rc=(int)syscall(__NR_io_uring_enter,ringfd_,tosubmit,wait?1:0,
+    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,&arg,sizeof(arg));
+  if(rc<0&&errno!=EINTR&&errno!=ETIME&&errno!=EAGAIN&&errno!=EBUSY)
   {
-    for(size_t s=0;s<delarray_.size();++s)
+    char err[256];
+    strerror_r(errno,err,sizeof(err));
+    LOG_INFO("io_uring_enter return errno=%d,'%s'",errno,err);
+  }
+  return rc;
+}
+
+int net::UringPoller::poll(int maxwait)
+{
+  int64_t timeout=wait_time(timer_.invoke_timer(),maxwait);
+  size_t keep=0;
+  for(size_t i=0;i<rearmarray_.size();++i)
+  {
+    if(!arm(rearmarray_[i]))
+      rearmarray_[keep++]=rearmarray_[i];
+  }
+  rearmarray_.resize(keep);
+  bool ready=__atomic_load_n(cqtail_,__ATOMIC_ACQUIRE)!=*cqhead_;
+  bool pending=sqlocal_!=__atomic_load_n(sqhead_,__ATOMIC_ACQUIRE);
+  bool overflow=(__atomic_load_n(sqflags_,__ATOMIC_RELAXED)&IORING_SQ_CQ_OVERFLOW)!=0;
+  if(!ready&&timeout!=0)
+    enter(timeout,true);
+  else if(pending||overflow)
+    enter(0,false);
+  return reap();
+}
+
+void net::UringPoller::on_recv(int fd,uint32_t tag,int res,unsigned flags)
+{
+  UringFdEntry* entry=(size_t)fd<fdarray_.size()?&fdarray_[fd]:nullptr;
+  bool live=entry&&entry->hander_&&entry->kind_==URING_RECV&&(entry->gen_&0xffff)==(tag>>16);
+  if(live&&entry->opseq_==(uint16_t)tag&&!(flags&IORING_CQE_F_MORE))
+  {
+    entry->oparmed_=false;
+    if(entry->event_&POLLIN)
+      enqueue(fd);
+  }
+  if(!(flags&IORING_CQE_F_BUFFER))
+  {
+    // out of buffers re-arms,a cancelled request just ends
+    if(live&&res!=-ENOBUFS&&res!=-ECANCELED)
+      entry->hander_->handle_recv(nullptr,res);
+    return;
+  }
+  unsigned bid=flags>>IORING_CQE_BUFFER_SHIFT;
+  // bytes of a recv cancelled by reset_poll_in are delivered all the same
+  if(live)
+    entry->hander_->handle_recv(bufs_+(size_t)bid*ezRecvBufSize,res);
+  recycle_buf(bid);
+}
+
+void net::UringPoller::on_accept(int fd,uint32_t tag,int res,unsigned flags)
+{
+  UringFdEntry* entry=(size_t)fd<fdarray_.size()?&fdarray_[fd]:nullptr;
+  bool live=entry&&entry->hander_&&entry->kind_==URING_ACCEPT&&(entry->gen_&0xffff)==(tag>>16);
+  if(live&&entry->opseq_==(uint16_t)tag&&!(flags&IORING_CQE_F_MORE))
+  {
+    entry->oparmed_=false;
+    if(entry->event_&POLLIN)
+      enqueue(fd);
+  }
+  if(res>=0)
+  {
+    if(live)
+      entry->hander_->handle_accept(res);
+    else
+      close(res);
+    return;
+  }
+  // out of fds and the like,the hander's own accept path deals with it
+  if(live&&res!=-ECANCELED)
+    entry->hander_->handle_in_event();
+}
+
+// the hander drains what went out and sends the rest with a new request
+void net::UringPoller::on_send(int fd,uint32_t tag,int res)
+{
+  UringFdEntry* entry=(size_t)fd<fdarray_.size()?&fdarray_[fd]:nullptr;
+  UringSend* send=nullptr;
+  if(entry&&entry->hander_&&entry->gen_==tag&&entry->send_)
+  {
+    // socket buffer full,let the kernel wait for room before trying again
+    if(res==-EAGAIN&&submit_send(fd,entry->send_,IORING_RECVSEND_POLL_FIRST))
+      return;
+    send=entry->send_;
+    entry->send_=nullptr;
+  }
+  else
+  {
+    uint64_t data=make_tag(tag,URING_SEND,fd);
+    for(size_t i=0;i<orphansends_.size();++i)
     {
-      delete fdarray_[delarray_[s]];
-      fdarray_[delarray_[s]]=nullptr;
+      if(orphansends_[i]->tag_==data)
+      {
+        send=orphansends_[i];
+        orphansends_.erase(orphansends_.begin()+i);
+        break;
+      }
     }
-    delarray_.clear();
-    willdelfd_=false;
+    if(!send)
+      return;
   }
+  IPollerEventHander* hander=send->hander_;
+  free_send(send);
+  hander->handle_sent(res);
 }
 
-void net::EpollPoller::add_timer(int64_t timeout,IPollerEventHander* hander)
+int net::UringPoller::reap()
+{
+  int fired=0;
+  unsigned head=*cqhead_;
+  unsigned tail=__atomic_load_n(cqtail_,__ATOMIC_ACQUIRE);
+  while(head!=tail)
+  {
+    io_uring_cqe* cqe=&cqes_[head&cqmask_];
+    uint64_t data=cqe->user_data;
+    int res=cqe->res;
+    unsigned flags=cqe->flags;
+    // release the slot before dispatch,handers may submit and complete inline
+    __atomic_store_n(cqhead_,++head,__ATOMIC_RELEASE);
+    if(data==0)
+      continue;
+    int fd=(int)(data&0xffffff);
+    int kind=(int)((data>>24)&0xff);
+    uint32_t tag=(uint32_t)(data>>32);
+    if(kind!=URING_POLL)
+    {
+      ++fired;
+      if(kind==URING_RECV)
+        on_recv(fd,tag,res,flags);
+      else if(kind==URING_ACCEPT)
+        on_accept(fd,tag,res,flags);
+      else
+        on_send(fd,tag,res);
+      continue;
+    }
+    if((size_t)fd>=fdarray_.size())
+      continue;
+    UringFdEntry* entry=&fdarray_[fd];
+    if(!entry->hander_||entry->seq_!=tag)
+      continue;
+    if(!(flags&IORING_CQE_F_MORE))
+    {
+      entry->armed_=false;
+      rearm(fd);
+    }
+    if(res<0)
+      continue;
+    ++fired;
+    // fdarray_ may grow while dispatching,check by index and generation
+    uint32_t gen=entry->gen_;
+    IPollerEventHander* hander=entry->hander_;
+    if(res&POLLERR)
+      hander->handle_error_event();
+    else if(res&POLLHUP)
+      hander->handle_in_event();
+    if(!fdarray_[fd].hander_||fdarray_[fd].gen_!=gen)
+      continue;
+    if(res&POLLOUT)
+      hander->handle_out_event();
+    if(!fdarray_[fd].hander_||fdarray_[fd].gen_!=gen)
+      continue;
+    if(res&POLLIN)
+      hander->handle_in_event();
+  }
+  return fired;
+}
+
+void net::UringPoller::add_timer(int64_t timeout,IPollerEventHander* hander)
 {
   timer_.add_timer(hander,timeout);
 }
 
-void net::EpollPoller::del_timer(IPollerEventHander* hander)
+void net::UringPoller::del_timer(IPollerEventHander* hander)
 {
   timer_.del_timer(hander);
 }
 #endif
 
+net::IPollerEventHander::~IPollerEventHander()
+{
+  if(timernode_.timer_)
+    timernode_.timer_->del_timer(this);
+}
+
+net::PollTimer::PollTimer():jiffies_(base::now_tick()),count_(0)
+{
+  for(int i=0;i<TVR_SIZE;++i)
+    list_init(&tv1_[i]);
+  for(int l=0;l<TVN_LEVEL;++l)
+    for(int i=0;i<TVN_SIZE;++i)
+      list_init(&tvn_[l][i]);
+}
+
+net::PollTimer::~PollTimer()
+{
+  for(int i=0;i<TVR_SIZE;++i)
+    while(tv1_[i].next_!=&tv1_[i])
+      del_timer(tv1_[i].next_->hander_);
+  for(int l=0;l<TVN_LEVEL;++l)
+    for(int i=0;i<TVN_SIZE;++i)
+      while(tvn_[l][i].next_!=&tvn_[l][i])
+        del_timer(tvn_[l][i].next_->hander_);
+}
+
+void net::PollTimer::list_init(PollTimerNode* head)
+{
+  head->prev_=head;
+  head->next_=head;
+}
+
+void net::PollTimer::list_add(PollTimerNode* node,PollTimerNode* head)
+{
+  node->prev_=head->prev_;
+  node->next_=head;
+  head->prev_->next_=node;
+  head->prev_=node;
+}
+
+void net::PollTimer::list_del(PollTimerNode* node)
+{
+  node->prev_->next_=node->next_;
+  node->next_->prev_=node->prev_;
+  node->prev_=nullptr;
+  node->next_=nullptr;
+}
+
+void net::PollTimer::add_node(PollTimerNode* node)
+{
+  int64_t expire=node->expire_;
+  int64_t idx=expire-jiffies_;
+  PollTimerNode* head=nullptr;
+  if(idx<0)
+    head=&tv1_[jiffies_&TVR_MASK];
+  else if(idx<TVR_SIZE)
+    head=&tv1_[expire&TVR_MASK];
+  else
+  {
+    int level=0;
+    for(;level<TVN_LEVEL-1;++level)
+    {
+      if(idx<((int64_t)1<<(TVR_BITS+(level+1)*TVN_BITS)))
+        break;
+    }
+    // beyond the wheel range(~49 days),park in the last slot of the top level
+    int64_t maxidx=((int64_t)1<<(TVR_BITS+TVN_LEVEL*TVN_BITS))-1;
+    if(idx>maxidx)
+      expire=jiffies_+maxidx;
+    head=&tvn_[level][(expire>>(TVR_BITS+level*TVN_BITS))&TVN_MASK];
+  }
+  list_add(node,head);
+}
+
+int net::PollTimer::cascade(int level,int idx)
+{
+  PollTimerNode* head=&tvn_[level][idx];
+  PollTimerNode tmp;
+  list_init(&tmp);
+  if(head->next_!=head)
+  {
+    tmp.next_=head->next_;
+    tmp.prev_=head->prev_;
+    tmp.next_->prev_=&tmp;
+    tmp.prev_->next_=&tmp;
+    list_init(head);
+  }
+  while(tmp.next_!=&tmp)
+  {
+    PollTimerNode* node=tmp.next_;
+    list_del(node);
+    add_node(node);
+  }
+  return idx;
+}
+
 void net::PollTimer::add_timer(IPollerEventHander* hander,int64_t timeout)
 {
-  if(map_.find(hander)!=map_.end())
-    return;
-  PollTimerEntry* entry=new PollTimerEntry;
-  entry->fired_time_=base::now_tick()+timeout;
-  entry->hander_=hander;
-  heap_.push(entry);
-  map_[hander]=entry;
+  PollTimerNode* node=&hander->timernode_;
+  if(node->timer_)
+    del_timer(hander);
+  node->expire_=base::now_tick()+(timeout>0?timeout:0);
+  node->timer_=this;
+  add_node(node);
+  ++count_;
 }
 
 void net::PollTimer::del_timer(IPollerEventHander* hander)
 {
-  auto iter=map_.find(hander);
-  if(iter!=map_.end())
-    iter->second->hander_=NULL;
+  PollTimerNode* node=&hander->timernode_;
+  if(node->timer_!=this)
+    return;
+  list_del(node);
+  node->timer_=nullptr;
+  --count_;
 }
 
 int64_t net::PollTimer::invoke_timer()
 {
-  if(heap_.empty())
-    return 0;
-  int64_t cur=base::now_tick();
-  while(!heap_.empty())
+  return invoke_timer(base::now_tick());
+}
+
+int64_t net::PollTimer::invoke_timer(int64_t now)
+{
+  if(count_==0)
   {
-    PollTimerEntry* entry=heap_.top();
-    if(entry->fired_time_>cur)
-      return entry->fired_time_-cur;
-    if(entry->hander_)
-      entry->hander_->handle_timer();
-    heap_.pop();
-    auto iter=map_.find(entry->hander_);
-    if(iter!=map_.end())
-      map_.erase(iter);
+    jiffies_=now+1;
+    return -1;
   }
-  return 0;
+  PollTimerNode expired;
+  while(jiffies_<=now)
+  {
+    int idx=(int)(jiffies_&TVR_MASK);
+    if(!idx)
+    {
+      for(int l=0;l<TVN_LEVEL;++l)
+      {
+        if(cascade(l,(int)((jiffies_>>(TVR_BITS+l*TVN_BITS))&TVN_MASK)))
+          break;
+      }
+    }
+    ++jiffies_;
+    // splice the whole slot out first,handers may re-arm while firing
+    PollTimerNode* head=&tv1_[idx];
+    if(head->next_==head)
+      continue;
+    expired.next_=head->next_;
+    expired.prev_=head->prev_;
+    expired.next_->prev_=&expired;
+    expired.prev_->next_=&expired;
+    list_init(head);
+    while(expired.next_!=&expired)
+    {
+      PollTimerNode* node=expired.next_;
+      list_del(node);
+      node->timer_=nullptr;
+      --count_;
+      node->hander_->handle_timer();
+    }
+  }
+  return next_timeout(now);
 }
 
-net::Poller* net::create_poller()
+int64_t net::PollTimer::next_timeout(int64_t now)
 {
+  if(count_==0)
+    return -1;
+  // only look up to the next cascade,later slots may be refilled by it
+  int idx=(int)(jiffies_&TVR_MASK);
+  for(int i=idx;i<TVR_SIZE;++i)
+  {
+    if(tv1_[i].next_!=&tv1_[i])
+      return jiffies_+(i-idx)-now;
+  }
+  return jiffies_+(TVR_SIZE-idx)-now;
+}
+
+net::Poller* net::create_poller(bool uring)
+{
+#ifdef NET_HAVE_IO_URING
+  if(uring)
+  {
+    UringPoller* poller=new UringPoller;
+    if(poller->initialize(1024))
+      return poller;
+    LOG_INFO("io_uring not supported,fall back to epoll");
+    delete poller;
+  }
+#endif
 #ifdef __linux__
   return new EpollPoller;
 #else
@@ -1,17 +1,59 @@
 #ifndef _POLLER_H
 #define _POLLER_H
-#include <queue>
-#include <unordered_map>
+#include <stdint.h>
+#include <vector>
+#include "socket.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)&&defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NET_HAVE_IO_URING
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+#endif
+#endif
 
 namespace net
 {
+  class PollTimer;
+  class IPollerEventHander;
+
+  // intrusive timing wheel link,one per hander,so arming a timer never allocates
+  struct PollTimerNode
+  {
+    PollTimerNode*      prev_;
+    PollTimerNode*      next_;
+    int64_t             expire_;
+    PollTimer*          timer_;
+    IPollerEventHander* hander_;
+    PollTimerNode():prev_(nullptr),next_(nullptr),expire_(0),timer_(nullptr),hander_(nullptr){}
+  };
+
   class IPollerEventHander
   {
   public:
-    virtual ~IPollerEventHander(){}
+    IPollerEventHander(){timernode_.hander_=this;}
+    virtual ~IPollerEventHander();
     virtual void handle_in_event()=0;
     virtual void handle_out_event()=0;
+    // EPOLLERR,also raised for MSG_ZEROCOPY completions on the error queue
+    virtual void handle_error_event(){handle_in_event();}
     virtual void handle_timer()=0;
+    // completions for fds added with add_accept_fd/add_recv_fd:an accepted socket,
+    // received bytes(0 peer closed,<0 -errno).the data is only valid during the call
+    virtual void handle_accept(int fd){}
+    virtual void handle_recv(const char* data,int len){}
+    // a send request is done,res bytes went out or -errno.once per Poller::send,
+    // also when the fd was deleted meanwhile
+    virtual void handle_sent(int res){}
+  private:
+    PollTimerNode timernode_;
+    friend class PollTimer;
   };
 
   class Poller
@@ -21,40 +63,61 @@ namespace net
     virtual void add_timer(int64_t timeout,IPollerEventHander* hander)=0;
     virtual void del_timer(IPollerEventHander* hander)=0;
     virtual bool add_fd(int fd,IPollerEventHander* hander)=0;
+    // register read and write interest edge-triggered,return false if unsupported
+    virtual bool add_edge_fd(int fd,IPollerEventHander* hander){return false;}
     virtual void del_fd(int fd)=0;
     virtual void set_poll_in(int fd)=0;
     virtual void reset_poll_in(int fd)=0;
     virtual void set_poll_out(int fd)=0;
     virtual void reset_poll_out(int fd)=0;
-    virtual void poll()=0;
+    // completion backends,false if unsupported.while poll in is set the poller accepts
+    // or receives itself and calls handle_accept/handle_recv instead of handle_in_event
+    virtual bool add_accept_fd(int fd,IPollerEventHander* hander){return false;}
+    virtual bool add_recv_fd(int fd,IPollerEventHander* hander){return false;}
+    // fd added with add_recv_fd:send iov with one request,false if it can't be queued or
+    // the previous one is in flight.the memory iov points to is read until handle_sent
+    virtual bool send(int fd,const IoVec* iov,int cnt){return false;}
+    // wait at most maxwait ms(-1 until next timer or fd event),return fired fd events
+    virtual int  poll(int maxwait)=0;
     virtual long get_load()=0;
   };
 
-  struct PollTimerEntry
-  {
-    int64_t             fired_time_;
-    IPollerEventHander* hander_;
-    PollTimerEntry():fired_time_(0),hander_(NULL){}
-  };
-  struct PollCmp
-  {
-    bool operator()(const PollTimerEntry* a,const PollTimerEntry* b)
-    {
-      return a->fired_time_>b->fired_time_;
-    }
-  };
-  typedef std::priority_queue<PollTimerEntry*,std::vector<PollTimerEntry*>,PollCmp> POLL_TIMER_HEAP;
-  typedef std::unordered_map<IPollerEventHander*,PollTimerEntry*> POLL_TIMER_MAP;
-
+  // hierarchical timing wheel with 1ms ticks(linux kernel timer layout):
+  // 256 slots for the next 256ms,then 4 levels of 64 slots cascaded down
   class PollTimer
   {
   public:
+    PollTimer();
+    ~PollTimer();
+    // re-arming a hander that already has a timer reschedules it
     void add_timer(IPollerEventHander* hander,int64_t timeout);
     void del_timer(IPollerEventHander* hander);
+    // fire expired timers,return ms to the next deadline or -1 if none
     int64_t invoke_timer();
+    int64_t invoke_timer(int64_t now);
+    size_t  size() {return count_;}
   private:
-    POLL_TIMER_HEAP heap_;
-    POLL_TIMER_MAP  map_;
+    enum
+    {
+      TVR_BITS=8,
+      TVN_BITS=6,
+      TVR_SIZE=1<<TVR_BITS,
+      TVN_SIZE=1<<TVN_BITS,
+      TVR_MASK=TVR_SIZE-1,
+      TVN_MASK=TVN_SIZE-1,
+      TVN_LEVEL=4,
+    };
+    void add_node(PollTimerNode* node);
+    int  cascade(int level,int idx);
+    int64_t next_timeout(int64_t now);
+    static void list_init(PollTimerNode* head);
+    static void list_add(PollTimerNode* node,PollTimerNode* head);
+    static void list_del(PollTimerNode* node);
+  private:
+    PollTimerNode tv1_[TVR_SIZE];
+    PollTimerNode tvn_[TVN_LEVEL][TVN_SIZE];
+    int64_t       jiffies_;
+    size_t        count_;
   };
 
   class SelectPoller:public Poller
@@ -70,7 +133,7 @@ namespace net
     virtual void reset_poll_in(int fd);
     virtual void set_poll_out(int fd);
     virtual void reset_poll_out(int fd);
-    virtual void poll();
+    virtual int  poll(int maxwait);
     virtual long  get_load(){return load_.Get();}
   private:
     struct SelectFdEntry
@@ -92,10 +155,9 @@ namespace net
     bool   willdelfd_;
     base::AtomicNumber load_;
   };
-  Poller*   create_poller();
+  // uring:try the io_uring backend first,fall back when the kernel lacks it
+  Poller*   create_poller(bool uring=false);
 #ifdef __linux__
-#include <sys/epoll.h>
-#include <unistd.h>
   class EpollPoller:public Poller
   {
   public:
@@ -105,23 +167,28 @@ namespace net
     virtual void add_timer(int64_t timeout,IPollerEventHander* hander);
     virtual void del_timer(IPollerEventHander* hander);
     virtual bool add_fd(int fd,IPollerEventHander* hander);
+    virtual bool add_edge_fd(int fd,IPollerEventHander* hander);
     virtual void del_fd(int fd);
     virtual void set_poll_in(int fd);
     virtual void reset_poll_in(int fd);
     virtual void set_poll_out(int fd);
     virtual void reset_poll_out(int fd);
-    virtual void poll();
+    virtual int  poll(int maxwait);
     virtual long  get_load(){return load_.Get();}
   private:
+    // flat table indexed by fd,epoll data carries fd|gen<<32 so events of a
+    // deleted or reused fd are dropped by comparing generations
     struct EpollFdEntry
     {
-      int fd_;
-      int event_;
       IPollerEventHander* hander_;
+      uint32_t gen_;
+      int      event_;
     };
-    std::vector<EpollFdEntry*> fdarray_;
-    std::vector<int> delarray_;
-    bool willdelfd_;
+    bool add_entry(int fd,IPollerEventHander* hander,int event);
+    EpollFdEntry* get_entry(int fd);
+    void modify(int fd,EpollFdEntry* entry);
+    bool is_live(int fd,uint32_t gen);
+    std::vector<EpollFdEntry> fdarray_;
     PollTimer timer_;
   private:
     int epollfd_;
@@ -129,5 +196,126 @@ namespace net
     base::AtomicNumber   load_;
   };
 #endif
+#ifdef NET_HAVE_IO_URING
+  // io_uring poller,requests and re-arms queue in the submission ring and go to the
+  // kernel with the wait in one io_uring_enter,an idle spin makes no syscall.
+  // level fds use one-shot polls re-armed after dispatch,edge fds one multishot poll.
+  // listeners take one multishot accept,add_recv_fd fds one multishot recv into a
+  // provided buffer ring plus sendmsg requests straight from the hander's buffer,so a
+  // busy connection costs no syscall of its own
+  class UringPoller:public Poller
+  {
+  public:
+    static const unsigned ezRecvBufs=512;       // provided buffer ring,power of 2
+    static const unsigned ezRecvBufSize=4096;
+    static const int      ezSendIovs=16;
+    static const size_t   ezMaxFreeSends=256;
+  public:
+    UringPoller();
+    virtual ~UringPoller();
+    // map the rings,false if the kernel lacks io_uring,ext arg or the 5.19 opcodes.
+    // multishot recv needs 6.0,without it add_recv_fd fails and fds are polled
+    bool initialize(unsigned entries);
+
+    virtual void add_timer(int64_t timeout,IPollerEventHander* hander);
+    virtual void del_timer(IPollerEventHander* hander);
+    virtual bool add_fd(int fd,IPollerEventHander* hander);
+    virtual bool add_edge_fd(int fd,IPollerEventHander* hander);
+    virtual void del_fd(int fd);
+    virtual void set_poll_in(int fd);
+    virtual void reset_poll_in(int fd);
+    virtual void set_poll_out(int fd);
+    virtual void reset_poll_out(int fd);
+    virtual bool add_accept_fd(int fd,IPollerEventHander* hander);
+    virtual bool add_recv_fd(int fd,IPollerEventHander* hander);
+    virtual bool send(int fd,const IoVec* iov,int cnt);
+    virtual int  poll(int maxwait);
+    virtual long  get_load(){return load_.Get();}
+  private:
+    // user_data is tag<<32|kind<<24|fd,cancels carry 0
+    enum UringOpKind
+    {
+      URING_POLL,
+      URING_RECV,
+      URING_ACCEPT,
+      URING_SEND,
+    };
+    // the msghdr of a sendmsg request,the kernel reads it until the completion
+    struct UringSend
+    {
+      struct msghdr msg_;
+      IoVec    iov_[ezSendIovs];
+      IPollerEventHander* hander_;
+      uint64_t tag_;
+    };
+    struct UringFdEntry
+    {
+      IPollerEventHander* hander_;
+      uint32_t gen_;    // bumped on add/del,stale dispatch check
+      uint32_t seq_;    // bumped on every arm/cancel,stale cqe check
+      int      event_;
+      bool     edge_;
+      bool     armed_;
+      bool     queued_;
+      // URING_RECV/URING_ACCEPT:the request stands for poll in,polls only watch poll out
+      int      kind_;
+      uint16_t opseq_;  // tag is gen_<<16|opseq_,data of a cancelled recv is still delivered
+      bool     oparmed_;
+      UringSend* send_; // in flight send
+    };
+    bool add_entry(int fd,IPollerEventHander* hander,int event,bool edge,int kind=URING_POLL);
+    UringFdEntry* get_entry(int fd);
+    void enqueue(int fd);
+    void rearm(int fd);
+    bool arm(int fd);
+    bool arm_op(int fd);
+    bool submit_send(int fd,UringSend* send,unsigned flags);
+    void cancel(uint64_t tag);
+    void cancel_op(int fd);
+    void drop_send(int fd);
+    void on_recv(int fd,uint32_t tag,int res,unsigned flags);
+    void on_accept(int fd,uint32_t tag,int res,unsigned flags);
+    void on_send(int fd,uint32_t tag,int res);
+    bool setup_buf_ring();
+    void recycle_buf(unsigned bid);
+    UringSend* alloc_send();
+    void  free_send(UringSend* send);
+    io_uring_sqe* get_sqe();
+    int  enter(int64_t timeout,bool wait);
+    int  reap();
+    static uint64_t make_tag(uint32_t tag,int kind,int fd) {return ((uint64_t)tag<<32)|((uint64_t)kind<<24)|(uint32_t)fd;}
+    static uint32_t op_tag(const UringFdEntry& entry) {return ((entry.gen_&0xffff)<<16)|entry.opseq_;}
+  private:
+    std::vector<UringFdEntry> fdarray_;
+    std::vector<int> rearmarray_;
+    // sends whose fd was deleted in flight,their completion still goes to the hander
+    std::vector<UringSend*> orphansends_;
+    std::vector<UringSend*> freesends_;
+    bool          canrecv_;
+    io_uring_buf_ring* bufring_;
+    char*         bufs_;
+    unsigned short buftail_;
+    PollTimer timer_;
+    int           ringfd_;
+    void*         sqring_;
+    size_t        sqringsz_;
+    void*         cqring_;
+    size_t        cqringsz_;
+    io_uring_sqe* sqes_;
+    size_t        sqessz_;
+    unsigned*     sqhead_;
+    unsigned*     sqtail_;
+    unsigned*     sqflags_;
+    unsigned*     sqarray_;
+    unsigned      sqmask_;
+    unsigned      sqentries_;
+    unsigned      sqlocal_;
+    unsigned*     cqhead_;
+    unsigned*     cqtail_;
+    unsigned      cqmask_;
+    io_uring_cqe* cqes_;
+    base::AtomicNumber load_;
+  };
+#endif
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,251 @@
+#include "../base/portable.h"
+#include "shard.h"
+#include "net_interface.h"
+#include "connection.h"
+#include "fd.h"
+#include <assert.h>
+#include <algorithm>
+
+net::LogicShard::LogicShard(EventLoop* loop,int index)
+  :looper_(loop)
+  ,index_(index)
+  ,broadcasting_(0)
+{
+  evqueue_=new ThreadEvQueue;
+  poller_=create_poller(loop->has_flag(EVLOOP_IO_URING));
+  poller_->add_fd(evqueue_->get_fd(),this);
+  poller_->set_poll_in(evqueue_->get_fd());
+}
+
+net::LogicShard::~LogicShard()
+{
+  if(poller_)
+    delete poller_;
+  if(evqueue_)
+    delete evqueue_;
+}
+
+void net::LogicShard::loop(int maxwait)
+{
+  // io threads only write the eventfd once we announced the wait,drain the queue every call
+  bool block=maxwait!=0&&evqueue_->prepare_wait();
+  poller_->poll(block?maxwait:0);
+  evqueue_->finish_wait();
+  dispatch_events();
+}
+
+void net::LogicShard::handle_in_event()
+{
+  evqueue_->consume_signal();
+  dispatch_events();
+}
+
+void net::LogicShard::dispatch_events()
+{
+  ThreadEvent ev;
+  while(evqueue_->recv(ev))
+  {
+    ev.hander_->process_event(ev);
+  }
+}
+
+void net::LogicShard::add_connection(Connection* con)
+{
+  base::Locker lock(&connlock_);
+  assert(conns_.find(con)==conns_.end());
+  conns_.insert(con);
+}
+
+void net::LogicShard::del_connection(Connection* con)
+{
+  {
+    base::Locker lock(&connlock_);
+    auto iter=conns_.find(con);
+    assert(iter!=conns_.end());
+    conns_.erase(iter);
+  }
+  std::vector<std::string> groups;
+  groups.swap(con->get_groups());
+  for(size_t i=0;i<groups.size();++i)
+    leave_group(groups[i],con);
+  if(con->is_dirty())
+    dirtyconns_.erase(std::remove(dirtyconns_.begin(),dirtyconns_.end(),con),dirtyconns_.end());
+}
+
+int net::LogicShard::get_connection_num()
+{
+  base::Locker lock(&connlock_);
+  return conns_.size();
+}
+
+void net::LogicShard::close_connections()
+{
+  base::Locker lock(&connlock_);
+  for(auto iter=conns_.begin();iter!=conns_.end();++iter)
+  {
+    (*iter)->active_close();
+  }
+}
+
+static bool by_tid(const net::ThreadEvent& a,const net::ThreadEvent& b)
+{
+  return a.hander_->get_tid()<b.hander_->get_tid();
+}
+
+void net::LogicShard::flush_connections()
+{
+  for(size_t i=0;i<dirtyconns_.size();++i)
+  {
+    ThreadEvent ev;
+    if(dirtyconns_[i]->is_dirty()&&dirtyconns_[i]->prepare_flush(ev))
+      flushevs_.push_back(ev);
+  }
+  dirtyconns_.clear();
+  if(flushevs_.empty())
+    return;
+  std::stable_sort(flushevs_.begin(),flushevs_.end(),by_tid);
+  size_t start=0;
+  for(size_t i=1;i<=flushevs_.size();++i)
+  {
+    int tid=flushevs_[start].hander_->get_tid();
+    if(i==flushevs_.size()||flushevs_[i].hander_->get_tid()!=tid)
+    {
+      looper_->occer_events(tid,&flushevs_[start],(int)(i-start));
+      start=i;
+    }
+  }
+  flushevs_.clear();
+}
+
+void net::LogicShard::broadcast(Connection** conns,int n,Msg* msg)
+{
+  // encode once,every target queues the same frame
+  Msg frame;
+  msg_init(&frame);
+  if(looper_->get_encoder()->encode_frame(msg,&frame))
+  {
+    if(msg_is_droppable(msg))
+      msg_set_droppable(&frame);
+    msg_free(msg);
+  }
+  else
+    msg_move(msg,&frame);
+  int live=0;
+  for(int i=0;i<n;++i)
+  {
+    if(conns[i]->get_client())
+      ++live;
+  }
+  if(live==0)
+  {
+    msg_free(&frame);
+    return;
+  }
+  // one refcount bump covers all targets,each one frees its own copy
+  msg_add_ref(&frame,live-1);
+  int threadnum=looper_->get_thread_num();
+  bool autoflush=looper_->is_auto_flush();
+  // CLOSE_FD for a target already in a task would reach its io thread before the task,
+  // slow consumers are closed after the tasks are posted
+  std::vector<BroadcastTask*> nested;
+  std::vector<BroadcastTask*>& tasks=broadcasting_==0?bcasttasks_:nested;
+  ++broadcasting_;
+  tasks.assign(threadnum+1,nullptr);
+  for(int i=0;i<n;++i)
+  {
+    if(!conns[i]->get_client())
+      continue;
+    Msg copy=frame;
+    // dropped or closed as a slow consumer
+    if(!conns[i]->queue_msg(copy))
+      continue;
+    ClientFd* client=conns[i]->get_client();
+    if(!autoflush)
+      conns[i]->mark_dirty();
+    else if(client->mark_flush_pending())
+    {
+      int tid=client->get_tid();
+      if(!tasks[tid])
+        tasks[tid]=new BroadcastTask(looper_,tid);
+      tasks[tid]->add_target(client);
+    }
+  }
+  for(int tid=1;tid<=threadnum;++tid)
+  {
+    if(tasks[tid])
+    {
+      ThreadEvent ev;
+      ev.type_=ThreadEvent::BROADCAST;
+      tasks[tid]->occur_event(ev);
+    }
+  }
+  if(--broadcasting_>0)
+    return;
+  for(size_t i=0;i<deferredclose_.size();++i)
+    deferredclose_[i]->close_client();
+  deferredclose_.clear();
+}
+
+bool net::LogicShard::defer_close(Connection* con)
+{
+  if(broadcasting_==0)
+    return false;
+  deferredclose_.push_back(con);
+  return true;
+}
+
+void net::LogicShard::join_group(const std::string& group,Connection* con)
+{
+  if(groups_[group].insert(con).second)
+    con->get_groups().push_back(group);
+}
+
+void net::LogicShard::leave_group(const std::string& group,Connection* con)
+{
+  auto iter=groups_.find(group);
+  if(iter==groups_.end()||iter->second.erase(con)==0)
+    return;
+  if(iter->second.empty())
+    groups_.erase(iter);
+  std::vector<std::string>& groups=con->get_groups();
+  groups.erase(std::remove(groups.begin(),groups.end(),group),groups.end());
+}
+
+void net::LogicShard::group_broadcast(const std::string& group,Msg* msg)
+{
+  auto iter=groups_.find(group);
+  if(iter==groups_.end())
+  {
+    msg_free(msg);
+    return;
+  }
+  bcastconns_.assign(iter->second.begin(),iter->second.end());
+  broadcast(bcastconns_.data(),(int)bcastconns_.size(),msg);
+}
+
+net::ShardFlushTask::ShardFlushTask(EventLoop* looper,int shard)
+  :ThreadEventHander(looper,looper->get_shard_tid(shard))
+  ,shard_(shard)
+{
+}
+
+void net::ShardFlushTask::process_event(ThreadEvent& ev)
+{
+  get_looper()->flush_connections(shard_);
+  delete this;
+}
+
+net::ShardMsgTask::ShardMsgTask(EventLoop* looper,int shard,Msg* msg)
+  :ThreadEventHander(looper,looper->get_shard_tid(shard))
+  ,shard_(shard)
+{
+  msg_init(&msg_);
+  msg_move(msg,&msg_);
+}
+
+void net::ShardMsgTask::process_event(ThreadEvent& ev)
+{
+  get_looper()->get_hander()->on_shard_message(shard_,&msg_);
+  msg_free(&msg_);
+  delete this;
+}
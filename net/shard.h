@@ -0,0 +1,86 @@
+#ifndef _NET_SHARD_H
+#define _NET_SHARD_H
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <unordered_map>
+#include "../base/thread.h"
+#include "event.h"
+#include "poller.h"
+
+namespace net
+{
+  class Connection;
+  class BroadcastTask;
+
+  // one logic thread's connections and event queue.shard 0 is the main queue driven by
+  // event_process,the others by event_process_shard.everything but conns_ belongs to
+  // the thread driving the shard
+  class LogicShard:public IPollerEventHander
+  {
+  public:
+    LogicShard(EventLoop* loop,int index);
+    virtual ~LogicShard();
+    ThreadEvQueue* get_ev_queue() {return evqueue_;}
+    int  get_index() {return index_;}
+    void loop(int maxwait);
+    void add_connection(Connection* con);
+    void del_connection(Connection* con);
+    int  get_connection_num();
+    // shutdown,the io threads are the only other threads left
+    void close_connections();
+    void add_dirty_connection(Connection* con) {dirtyconns_.push_back(con);}
+    void flush_connections();
+    void broadcast(Connection** conns,int n,Msg* msg);
+    // a slow consumer to close while a broadcast is under way,closed once its flush tasks
+    // are posted.false if no broadcast is running
+    bool defer_close(Connection* con);
+    void join_group(const std::string& group,Connection* con);
+    void leave_group(const std::string& group,Connection* con);
+    void group_broadcast(const std::string& group,Msg* msg);
+
+    virtual void handle_in_event();
+    virtual void handle_out_event(){}
+    virtual void handle_timer(){}
+  private:
+    void dispatch_events();
+  private:
+    EventLoop*                        looper_;
+    int                               index_;
+    Poller*                           poller_;
+    ThreadEvQueue*                    evqueue_;
+    std::unordered_set<Connection*>   conns_;
+    // io threads add and remove connections too with EVLOOP_IO_HANDLER
+    base::SpinLock                    connlock_;
+    std::vector<Connection*>          dirtyconns_;
+    std::vector<ThreadEvent>          flushevs_;
+    std::unordered_map<std::string,std::unordered_set<Connection*> > groups_;
+    std::vector<Connection*>          bcastconns_;
+    std::vector<BroadcastTask*>       bcasttasks_;
+    // nesting depth,on_high_watermark may send or broadcast again
+    int                               broadcasting_;
+    std::vector<Connection*>          deferredclose_;
+  };
+
+  // flush the dirty connections of a shard on its own thread
+  class ShardFlushTask:public ThreadEventHander
+  {
+  public:
+    ShardFlushTask(EventLoop* looper,int shard);
+    virtual void process_event(ThreadEvent& ev);
+  private:
+    int shard_;
+  };
+
+  // a msg posted to another shard with shard_post
+  class ShardMsgTask:public ThreadEventHander
+  {
+  public:
+    ShardMsgTask(EventLoop* looper,int shard,Msg* msg);
+    virtual void process_event(ThreadEvent& ev);
+  private:
+    int shard_;
+    Msg msg_;
+  };
+}
+#endif
@@ -6,6 +6,9 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 namespace net
 {
@@ -273,12 +276,21 @@ namespace net
     return s;
   }
 
-  SOCKET CreateTcpServer(int port,char* bindaddr)
+  SOCKET CreateTcpServer(int port,char* bindaddr,bool reuseport)
   {
     struct sockaddr_in so;
     SOCKET s=CreateNonBlockSocket();
     if(s==INVALID_SOCKET)
       return -1;
+#ifdef SO_REUSEPORT
+    int on=1;
+    if(reuseport&&setsockopt(s,SOL_SOCKET,SO_REUSEPORT,(char*)&on,sizeof(on))==-1)
+    {
+      ezSocketError("setsockopt SO_REUSEPORT");
+      CloseSocket(s);
+      return INVALID_SOCKET;
+    }
+#endif
     memset(&so,0,sizeof(so));
     so.sin_family=AF_INET;
     so.sin_port = htons(port);
@@ -324,6 +336,26 @@ namespace net
     return connfd;
   }
 
+  SOCKET AcceptNonBlock(SOCKET sockfd, struct sockaddr_in* addr)
+  {
+    socklen_t addrlen = static_cast<socklen_t>(sizeof *addr);
+#ifdef __linux__
+    // TCP_NODELAY is inherited from the listener on linux
+    return ::accept4(sockfd, sockaddr_cast(addr), &addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    SOCKET connfd = ::accept(sockfd, sockaddr_cast(addr), &addrlen);
+    if(connfd==INVALID_SOCKET)
+    {
+      errno=wsa_error_to_errno(WSAGetLastError());
+      return INVALID_SOCKET;
+    }
+    int on=1;
+    setsockopt(connfd,IPPROTO_TCP,TCP_NODELAY,(const char*)&on,sizeof(on));
+    NonBlock(connfd);
+    return connfd;
+#endif
+  }
+
   int Connect(SOCKET sockfd, const struct sockaddr_in& addr)
   {
     return ::connect(sockfd, sockaddr_cast(&addr), static_cast<socklen_t>(sizeof addr));
@@ -355,6 +387,114 @@ namespace net
     return retval;
   }
 
+  int Readv(SOCKET sockfd, IoVec* iov, int cnt)
+  {
+#ifdef __linux__
+    return (int)::readv(sockfd,iov,cnt);
+#else
+    DWORD bytes=0;
+    DWORD flags=0;
+    if(::WSARecv(sockfd,iov,cnt,&bytes,&flags,nullptr,nullptr)!=0)
+    {
+      errno=WSAGetLastError();
+      if((errno==ENOENT)||(errno==WSAEWOULDBLOCK))
+        errno=EAGAIN;
+      return -1;
+    }
+    return (int)bytes;
+#endif
+  }
+
+  int Writev(SOCKET sockfd, const IoVec* iov, int cnt)
+  {
+#ifdef __linux__
+    return (int)::writev(sockfd,iov,cnt);
+#else
+    DWORD bytes=0;
+    if(::WSASend(sockfd,(LPWSABUF)iov,cnt,&bytes,0,nullptr,nullptr)!=0)
+    {
+      errno=wsa_error_to_errno(WSAGetLastError());
+      return -1;
+    }
+    return (int)bytes;
+#endif
+  }
+
+  bool EnableZeroCopy(SOCKET sockfd)
+  {
+#if defined(__linux__)&&defined(SO_ZEROCOPY)
+    int on=1;
+    return ::setsockopt(sockfd,SOL_SOCKET,SO_ZEROCOPY,&on,sizeof(on))==0;
+#else
+    return false;
+#endif
+  }
+
+  int GetIncomingCpu(SOCKET sockfd)
+  {
+#if defined(__linux__)&&defined(SO_INCOMING_CPU)
+    int cpu=-1;
+    socklen_t len=sizeof(cpu);
+    if(::getsockopt(sockfd,SOL_SOCKET,SO_INCOMING_CPU,&cpu,&len)!=0)
+      return -1;
+    return cpu;
+#else
+    return -1;
+#endif
+  }
+
+  bool SetIncomingCpu(SOCKET sockfd, int cpu)
+  {
+#if defined(__linux__)&&defined(SO_INCOMING_CPU)
+    return ::setsockopt(sockfd,SOL_SOCKET,SO_INCOMING_CPU,&cpu,sizeof(cpu))==0;
+#else
+    return false;
+#endif
+  }
+
+  int WritevZeroCopy(SOCKET sockfd, const IoVec* iov, int cnt)
+  {
+#if defined(__linux__)&&defined(MSG_ZEROCOPY)
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov=(struct iovec*)iov;
+    msg.msg_iovlen=cnt;
+    return (int)::sendmsg(sockfd,&msg,MSG_ZEROCOPY);
+#else
+    return Writev(sockfd,iov,cnt);
+#endif
+  }
+
+  int ReadZeroCopyDone(SOCKET sockfd, uint32_t& lo, uint32_t& hi, bool* copied)
+  {
+#if defined(__linux__)&&defined(SO_EE_ORIGIN_ZEROCOPY)
+    // skip anything on the error queue that isn't a zerocopy notification
+    while(true)
+    {
+      char control[128];
+      struct msghdr msg;
+      memset(&msg,0,sizeof(msg));
+      msg.msg_control=control;
+      msg.msg_controllen=sizeof(control);
+      if(::recvmsg(sockfd,&msg,MSG_ERRQUEUE)<0)
+        return (errno==EAGAIN||errno==EWOULDBLOCK)?0:-1;
+      for(struct cmsghdr* cm=CMSG_FIRSTHDR(&msg);cm;cm=CMSG_NXTHDR(&msg,cm))
+      {
+        struct sock_extended_err* serr=(struct sock_extended_err*)CMSG_DATA(cm);
+        if(serr->ee_errno!=0||serr->ee_origin!=SO_EE_ORIGIN_ZEROCOPY)
+          continue;
+        lo=serr->ee_info;
+        hi=serr->ee_data;
+        if(copied)
+          *copied=(serr->ee_code&SO_EE_CODE_ZEROCOPY_COPIED)!=0;
+        return 1;
+      }
+    }
+#else
+    return 0;
+#endif
+  }
+
   void CloseSocket(SOCKET sockfd)
   {
 #ifndef __linux__
@@ -364,6 +504,23 @@ namespace net
 #endif
   }
 
+  void AbortSocket(SOCKET sockfd)
+  {
+#ifdef __linux__
+    // connect to AF_UNSPEC disconnects tcp,the send queue is purged and its zerocopy
+    // completions posted while the error queue can still be read
+    struct sockaddr addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sa_family=AF_UNSPEC;
+    ::connect(sockfd,&addr,sizeof(addr));
+#else
+    struct linger lg;
+    lg.l_onoff=1;
+    lg.l_linger=0;
+    ::setsockopt(sockfd,SOL_SOCKET,SO_LINGER,(const char*)&lg,sizeof(lg));
+#endif
+  }
+
   void ShutdownWrite(SOCKET sockfd)
   {
     ::shutdown(sockfd,0);
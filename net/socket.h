@@ -1,11 +1,16 @@
 #ifndef _SOCKET_H
 #define _SOCKET_H
 #include "../base/portable.h"
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
 
 namespace net
 {
 #ifdef __linux__
 	typedef int SOCKET;
+	typedef struct iovec IoVec;
+	inline void SetIoVec(IoVec& v,void* p,size_t n){v.iov_base=p;v.iov_len=n;}
 #ifndef INVALID_SOCKET
 	#define INVALID_SOCKET (SOCKET)(~0)
 #endif
@@ -16,18 +21,37 @@ namespace net
 	int inet_aton(register const char *cp, struct in_addr *addr);
 	int inet_pton(int af, register const char *cp, struct in_addr *addr);
   int wsa_error_to_errno (int errcode);
+	typedef WSABUF IoVec;
+	inline void SetIoVec(IoVec& v,void* p,size_t n){v.buf=(char*)p;v.len=(ULONG)n;}
 #endif
 	bool InitNetwork(int version=2);
 	void NonBlock(SOCKET s);
 	SOCKET CreateNonBlockSocket();
-	SOCKET CreateTcpServer(int port,char* bindaddr);
+	SOCKET CreateTcpServer(int port,char* bindaddr,bool reuseport=false);
 	int Connect(SOCKET sockfd, const sockaddr_in& addr);
 	int Bind(SOCKET sockfd, const sockaddr_in& addr);
 	int Listen(SOCKET sockfd);
 	SOCKET Accept(SOCKET sockfd, sockaddr_in* addr);
+	// non-blocking,close-on-exec,TCP_NODELAY in one call where possible;quiet on EAGAIN
+	SOCKET AcceptNonBlock(SOCKET sockfd, sockaddr_in* addr);
 	int Read(SOCKET sockfd, void *buf, size_t count);
 	int Write(SOCKET sockfd, const void *buf, size_t count);
+	// scatter/gather versions of Read/Write,same return and errno conventions
+	int Readv(SOCKET sockfd, IoVec* iov, int cnt);
+	int Writev(SOCKET sockfd, const IoVec* iov, int cnt);
+	// MSG_ZEROCOPY(linux 4.14+):enable once per socket,send pins the pages until the
+	// kernel reports the send ids [lo,hi] done on the error queue;copied:kernel fell back to copying
+	bool EnableZeroCopy(SOCKET sockfd);
+	int  WritevZeroCopy(SOCKET sockfd, const IoVec* iov, int cnt);
+	// 1 got a completion,0 error queue empty,-1 error
+	int  ReadZeroCopyDone(SOCKET sockfd, uint32_t& lo, uint32_t& hi, bool* copied=nullptr);
+	// SO_INCOMING_CPU(linux 3.19+):cpu that processed the socket's packets,-1 unknown.
+	// on a SO_REUSEPORT listener set it to get the connections arriving on that cpu
+	int  GetIncomingCpu(SOCKET sockfd);
+	bool SetIncomingCpu(SOCKET sockfd, int cpu);
 	void CloseSocket(SOCKET s);
+	// reset the connection and drop what is queued for sending,the descriptor stays open
+	void AbortSocket(SOCKET s);
 	void ShutdownWrite(SOCKET s);
 
 	void ToIpPort(char* buf, size_t size,const sockaddr_in& addr);
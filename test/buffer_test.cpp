@@ -0,0 +1,215 @@
+#include "../base/portable.h"
+#include "../net/socket.h"
+#include "../net/netpack.h"
+#include "../net/buffer.h"
+#include "check.h"
+
+#include <sys/socket.h>
+#include <string.h>
+#include <cstdlib>
+#include <vector>
+
+using namespace net;
+
+static void fill(std::vector<char>& data,int seed)
+{
+  for(size_t i=0;i<data.size();++i)
+    data[i]=(char)(i*7+seed);
+}
+
+static bool same(const char* p,const std::vector<char>& data,size_t from,size_t len)
+{
+  return memcmp(p,&data[from],len)==0;
+}
+
+// bytes go in across blocks and come out in order,every drained block goes back
+static void test_add_remove()
+{
+  BufferPool pool(1024);
+  {
+    Buffer buf(&pool,1<<20);
+    std::vector<char> data(10000);
+    fill(data,1);
+    buf.add(&data[0],3000);
+    buf.add(&data[3000],7000);
+    CHECK_EQ(buf.off(),10000);
+    CHECK_EQ(pool.used_blocks(),10);
+    std::vector<char> out(10000);
+    CHECK_EQ(buf.remove(&out[0],1500),1500);
+    CHECK_EQ(buf.remove(&out[1500],8500),8500);
+    CHECK(out==data);
+    CHECK_EQ(buf.off(),0);
+    CHECK_EQ(pool.used_blocks(),0);
+    char* p=nullptr;
+    CHECK_EQ(buf.readable(p),0);
+  }
+  CHECK_EQ(pool.used_bytes(),0);
+}
+
+// pullup makes the asked bytes contiguous and leaves the rest where it is
+static void test_pullup()
+{
+  BufferPool pool(1024);
+  Buffer buf(&pool,1<<20);
+  std::vector<char> data(5000);
+  fill(data,2);
+  buf.add(&data[0],data.size());
+  buf.drain(1000);
+  char* p=nullptr;
+  CHECK_EQ(buf.readable(p),24);
+  // a frame straddling the block end
+  int n=buf.pullup(100);
+  CHECK(n>=100);
+  CHECK(n<1024);
+  CHECK_EQ(buf.readable(p),n);
+  CHECK(same(p,data,1000,n));
+  CHECK_EQ(buf.off(),4000);
+  // larger than a block gets a block of its own
+  n=buf.pullup(3000);
+  CHECK_EQ(n,3000);
+  CHECK_EQ(buf.readable(p),3000);
+  CHECK(same(p,data,1000,3000));
+  CHECK_EQ(buf.off(),4000);
+  std::vector<char> out(4000);
+  CHECK_EQ(buf.remove(&out[0],out.size()),4000);
+  CHECK(same(&out[0],data,1000,4000));
+  CHECK_EQ(pool.used_blocks(),0);
+}
+
+// a small read fills one block,no spare is taken for it
+static void test_readfd_small()
+{
+  int sv[2];
+  CHECK_EQ(socketpair(AF_UNIX,SOCK_STREAM,0,sv),0);
+  NonBlock(sv[0]);
+  BufferPool pool(1024);
+  Buffer buf(&pool,1<<20);
+  std::vector<char> data(100);
+  fill(data,3);
+  CHECK_EQ(Write(sv[1],&data[0],data.size()),100);
+  CHECK_EQ(buf.readfd(sv[0]),100);
+  CHECK_EQ(pool.used_blocks(),1);
+  CHECK_EQ(pool.free_blocks(),0);
+  char* p=nullptr;
+  CHECK_EQ(buf.readable(p),100);
+  CHECK(same(p,data,0,100));
+  // nothing to read,the borrowed block goes back
+  buf.drain(100);
+  CHECK(buf.readfd(sv[0])<0);
+  CHECK_EQ(pool.used_blocks(),0);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// a burst larger than a block lands in a chain,read again until the socket is dry
+static void test_readfd_chain()
+{
+  int sv[2];
+  CHECK_EQ(socketpair(AF_UNIX,SOCK_STREAM,0,sv),0);
+  NonBlock(sv[0]);
+  BufferPool pool(1024);
+  Buffer buf(&pool,1<<20);
+  std::vector<char> data(20000);
+  fill(data,4);
+  CHECK_EQ(Write(sv[1],&data[0],data.size()),(int)data.size());
+  while(buf.readfd(sv[0])>0)
+    ;
+  CHECK_EQ(buf.off(),data.size());
+  CHECK(pool.used_blocks()>=20);
+  std::vector<char> out(data.size());
+  CHECK_EQ(buf.remove(&out[0],out.size()),(int)out.size());
+  CHECK(out==data);
+  CHECK_EQ(pool.used_blocks(),0);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// writev across blocks until the socket is full,then carry on as the peer reads
+static void test_writefd()
+{
+  int sv[2];
+  CHECK_EQ(socketpair(AF_UNIX,SOCK_STREAM,0,sv),0);
+  NonBlock(sv[0]);
+  BufferPool pool(1024);
+  Buffer buf(&pool,1<<20);
+  std::vector<char> data(1<<20);
+  fill(data,5);
+  buf.add(&data[0],data.size());
+  std::vector<char> out;
+  std::vector<char> chunk(64*1024);
+  int rc=1;
+  while(rc==1)
+  {
+    rc=buf.writefd(sv[0]);
+    int n;
+    while((n=(int)recv(sv[1],&chunk[0],chunk.size(),MSG_DONTWAIT))>0)
+      out.insert(out.end(),chunk.begin(),chunk.begin()+n);
+  }
+  CHECK_EQ(rc,0);
+  CHECK_EQ(buf.off(),0);
+  CHECK(out==data);
+  CHECK_EQ(pool.used_blocks(),0);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+static int g_freed=0;
+
+static void count_free(void* data,void* hint)
+{
+  ++g_freed;
+  free(data);
+}
+
+// a referenced payload is written out of the msg itself,freed once it is all drained
+static void test_add_ref()
+{
+  BufferPool pool(1024);
+  Buffer buf(&pool,1<<20);
+  std::vector<char> data(5000);
+  fill(data,6);
+  Msg msg;
+  int8_t* payload=(int8_t*)malloc(data.size());
+  memcpy(payload,&data[0],data.size());
+  msg_init_data(&msg,payload,(int)data.size(),&count_free,nullptr);
+  g_freed=0;
+  buf.add("head",4);
+  buf.add_ref(&msg);
+  buf.add("tail",4);
+  CHECK_EQ(buf.off(),5008);
+  std::vector<char> out(5008);
+  CHECK_EQ(buf.remove(&out[0],2000),2000);
+  CHECK_EQ(g_freed,0);
+  CHECK_EQ(buf.remove(&out[2000],3008),3008);
+  CHECK_EQ(g_freed,1);
+  CHECK(memcmp(&out[0],"head",4)==0);
+  CHECK(same(&out[4],data,0,5000));
+  CHECK(memcmp(&out[5004],"tail",4)==0);
+}
+
+// idle blocks are freed by the next trim
+static void test_trim()
+{
+  BufferPool pool(1024);
+  {
+    Buffer buf(&pool,1<<20);
+    std::vector<char> data(8*1024);
+    buf.add(&data[0],data.size());
+  }
+  CHECK_EQ(pool.free_blocks(),8);
+  pool.trim();
+  pool.trim();
+  CHECK_EQ(pool.free_blocks(),0);
+}
+
+int main(int argc,char** argv)
+{
+  test_add_remove();
+  test_pullup();
+  test_readfd_small();
+  test_readfd_chain();
+  test_writefd();
+  test_add_ref();
+  test_trim();
+  return check_result("buffer_test");
+}
@@ -0,0 +1,36 @@
+#ifndef _CHECK_H
+#define _CHECK_H
+#include <cstdio>
+
+// minimal assertions for the ctest programs,a failed check is reported and counted,
+// main returns check_result()
+static int check_failures=0;
+
+#define CHECK(cond) \
+  do{ \
+    if(!(cond)) \
+    { \
+      printf("%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#cond); \
+      ++check_failures; \
+    } \
+  }while(0)
+
+#define CHECK_EQ(a,b) \
+  do{ \
+    long long va_=(long long)(a),vb_=(long long)(b); \
+    if(va_!=vb_) \
+    { \
+      printf("%s:%d: CHECK_EQ(%s,%s) failed,%lld!=%lld\n",__FILE__,__LINE__,#a,#b,va_,vb_); \
+      ++check_failures; \
+    } \
+  }while(0)
+
+static int check_result(const char* name)
+{
+  if(check_failures)
+    printf("%s:%d checks failed\n",name,check_failures);
+  else
+    printf("%s:ok\n",name);
+  return check_failures?1:0;
+}
+#endif
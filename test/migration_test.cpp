@@ -0,0 +1,260 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../net/socket.h"
+#include "../net/netpack.h"
+#include "../net/net_interface.h"
+#include "check.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include <string>
+
+using namespace net;
+
+// freed memory is poisoned and held back a while,a stale event reaching a deleted fd
+// crashes on it instead of reading what was left there
+static const int ezQuarantine=4096;
+static void* g_quarantine[ezQuarantine];
+static int g_qpos=0;
+static std::atomic_flag g_qlock=ATOMIC_FLAG_INIT;
+
+void operator delete(void* p) noexcept
+{
+  if(!p)
+    return;
+  memset(p,0xdd,malloc_usable_size(p));
+  while(g_qlock.test_and_set(std::memory_order_acquire))
+    ;
+  void* old=g_quarantine[g_qpos];
+  g_quarantine[g_qpos]=p;
+  g_qpos=(g_qpos+1)%ezQuarantine;
+  g_qlock.clear(std::memory_order_release);
+  free(old);
+}
+
+void operator delete(void* p,size_t) noexcept
+{
+  operator delete(p);
+}
+
+// a "S<4 digits>" frame holds up the io thread decoding it for that many ms
+class StallDecoder:public MsgDecoder
+{
+public:
+  StallDecoder():MsgDecoder(60000),stalls_(0){}
+  virtual int decode_buffer(IMessagePusher* pusher,Buffer* buffer,char* buf,size_t s)
+  {
+    if(s>=7&&buf[2]=='S')
+    {
+      int ms=0;
+      for(int i=3;i<7;++i)
+        ms=ms*10+buf[i]-'0';
+      stalls_.fetch_add(1);
+      base::sleep(ms);
+    }
+    return MsgDecoder::decode_buffer(pusher,buffer,buf,s);
+  }
+  std::atomic<int> stalls_;
+};
+
+// echoes everything,"I<k>" names the connection of client k
+class EchoHander:public IConnnectionHander
+{
+public:
+  EchoHander():closed_(0)
+  {
+    for(int i=0;i<3;++i)
+      conns_[i]=nullptr;
+  }
+  virtual void on_open(Connection* conn){}
+  virtual void on_close(Connection* conn) {++closed_;}
+  virtual void on_data(Connection* conn,Msg* msg)
+  {
+    int8_t* d=msg_data(msg);
+    if(msg_size(msg)==2&&d[0]=='I')
+      conns_[d[1]-'0']=conn;
+    Msg reply;
+    msg_init(&reply);
+    msg_copy(msg,&reply);
+    msg_send(conn,&reply);
+  }
+  Connection* conns_[3];
+  int closed_;
+};
+
+class RoundRobin:public IPlacementPolicy
+{
+public:
+  RoundRobin():next_(0){}
+  virtual int choose_thread(const IoThreadLoad* loads,int n,int64_t userdata) {return next_++%n;}
+private:
+  std::atomic<int> next_;
+};
+
+static EventLoop* g_loop=nullptr;
+
+static void pump(int ms)
+{
+  int64_t end=base::now_tick()+ms;
+  while(base::now_tick()<end)
+    event_process(g_loop,5);
+}
+
+static void send_frame(SOCKET s,const char* payload)
+{
+  std::string frame(2,'\0');
+  uint16_t len=(uint16_t)strlen(payload);
+  memcpy(&frame[0],&len,sizeof(len));
+  frame+=payload;
+  send(s,frame.data(),frame.size(),0);
+}
+
+// the next frame from s,the loop keeps running meanwhile.false on eof or after 3s
+static bool read_frame(SOCKET s,std::string& payload)
+{
+  std::string in;
+  int64_t end=base::now_tick()+3000;
+  while(base::now_tick()<end)
+  {
+    char buf[256];
+    int n=(int)recv(s,buf,sizeof(buf),MSG_DONTWAIT);
+    if(n==0)
+      return false;
+    if(n>0)
+      in.append(buf,n);
+    if(in.size()>=2)
+    {
+      uint16_t len=0;
+      memcpy(&len,in.data(),sizeof(len));
+      if(in.size()>=2u+len)
+      {
+        payload=in.substr(2,len);
+        return true;
+      }
+    }
+    event_process(g_loop,5);
+  }
+  return false;
+}
+
+static SOCKET connect_port(int port)
+{
+  SOCKET s=socket(AF_INET,SOCK_STREAM,0);
+  struct sockaddr_in addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_port=htons(port);
+  addr.sin_addr.s_addr=inet_addr("127.0.0.1");
+  if(::connect(s,(struct sockaddr*)&addr,sizeof(addr))!=0)
+  {
+    close(s);
+    return INVALID_SOCKET;
+  }
+  return s;
+}
+
+// a flush posted to the old thread between MIGRATE_FD and ADOPT_FD is still queued
+// there when the fd closes on the new thread:
+// the new thread is held up so ADOPT_FD waits and the flush goes to the old one,
+// then the old thread is held up until the fd has been adopted and its peer has closed
+// it.a close from our side would queue behind the flush instead.
+// the late flush must find the fd alive and pass it on,the others carry on unharmed
+static void test_stale_event_after_close(int port)
+{
+  StallDecoder decoder;
+  MsgEncoder encoder;
+  EchoHander hander;
+  RoundRobin placement;
+  g_loop=create_event_loop(&hander,&decoder,&encoder,2);
+  set_placement_policy(g_loop,&placement);
+  CHECK_EQ(serve_on_port(g_loop,port),0);
+  SOCKET cli[3];
+  std::string reply;
+  for(int i=0;i<3;++i)
+  {
+    cli[i]=connect_port(port);
+    CHECK(cli[i]!=INVALID_SOCKET);
+    char id[3]={'I',(char)('0'+i),0};
+    send_frame(cli[i],id);
+    CHECK(read_frame(cli[i],reply));
+  }
+  // a and b share a thread,c is on the other one
+  int a=-1,b=-1,c=-1;
+  for(int i=0;i<3;++i)
+  {
+    for(int j=0;j<3;++j)
+    {
+      if(i!=j&&get_connection_io_thread(hander.conns_[i])==get_connection_io_thread(hander.conns_[j]))
+      {
+        a=i;
+        b=j;
+        c=3-i-j;
+      }
+    }
+  }
+  CHECK(a>=0);
+  if(a<0)
+    return;
+  Connection* victim=hander.conns_[a];
+  int from=get_connection_io_thread(victim);
+  int to=get_connection_io_thread(hander.conns_[c]);
+  CHECK(from!=to);
+
+  send_frame(cli[c],"S0400");
+  while(decoder.stalls_.load()<1)
+    event_process(g_loop,5);
+  CHECK(migrate_connection(victim,to));
+  pump(50);
+  CHECK_EQ(get_connection_io_thread(victim),from);
+  send_frame(cli[b],"S1000");
+  while(decoder.stalls_.load()<2)
+    event_process(g_loop,5);
+  Msg msg;
+  msg_init_size(&msg,4);
+  memcpy(msg_data(&msg),"late",4);
+  msg_send(victim,&msg);
+  event_flush(g_loop);
+  int64_t end=base::now_tick()+3000;
+  while(get_connection_io_thread(victim)!=to&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK_EQ(get_connection_io_thread(victim),to);
+  close(cli[a]);
+  while(hander.closed_<1&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK_EQ(hander.closed_,1);
+  // the old thread gets to the stale flush before the echo of its own stall
+  CHECK(read_frame(cli[b],reply));
+  CHECK(reply=="S1000");
+  CHECK(read_frame(cli[c],reply));
+  CHECK(reply=="S0400");
+  send_frame(cli[b],"after");
+  CHECK(read_frame(cli[b],reply));
+  CHECK(reply=="after");
+  send_frame(cli[c],"after");
+  CHECK(read_frame(cli[c],reply));
+  CHECK(reply=="after");
+  close(cli[b]);
+  close(cli[c]);
+  end=base::now_tick()+3000;
+  while(hander.closed_<3&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK_EQ(hander.closed_,3);
+  destroy_event_loop(g_loop);
+  g_loop=nullptr;
+}
+
+int main(int argc,char** argv)
+{
+  net_initialize();
+  int port=20000+getpid()%20000;
+  test_stale_event_after_close(port);
+  return check_result("migration_test");
+}
@@ -0,0 +1,238 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../base/notifyqueue.h"
+#include "../net/netpack.h"
+#include "../net/msgpool.h"
+#include "../net/net_interface.h"
+#include "check.h"
+
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+using namespace net;
+
+static MsgPoolStats class_stats(size_t size)
+{
+  MsgPoolStats stats[64];
+  int n=get_msg_pool_stats(stats,64);
+  for(int i=0;i<n;++i)
+  {
+    if((size_t)stats[i].size_>=size)
+      return stats[i];
+  }
+  MsgPoolStats none={0,0,0,0,0};
+  return none;
+}
+
+// every size lands in a class that holds it,a freed block is the next one handed out
+static void test_classes()
+{
+  int last=0;
+  for(size_t size=1;size<=100000;size=size*3/2+1)
+  {
+    uint8_t cls=0;
+    char* p=(char*)msg_pool_alloc(size,cls);
+    memset(p,0x5a,size);
+    MsgPoolStats stats[64];
+    int n=get_msg_pool_stats(stats,64);
+    if(cls==ezMsgPoolNoClass)
+      CHECK((int)size>stats[n-1].size_);
+    else
+    {
+      CHECK(cls<n);
+      CHECK(stats[cls].size_>=(int)size);
+      CHECK(cls==0||stats[cls-1].size_<(int)size);
+      CHECK(cls>=last);
+      last=cls;
+    }
+    msg_pool_free(p,cls);
+    uint8_t cls2=0;
+    char* q=(char*)msg_pool_alloc(size,cls2);
+    CHECK_EQ(cls2,cls);
+    if(cls!=ezMsgPoolNoClass)
+      CHECK(q==p);
+    msg_pool_free(q,cls2);
+  }
+}
+
+// msgs of every size keep their payload,big ones past the last class included
+static void test_msgs()
+{
+  const int sizes[]={1,60,61,100,1000,4000,5000,70000,98000,200000};
+  for(size_t i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i)
+  {
+    Msg msg,copy;
+    msg_init_size(&msg,sizes[i]);
+    CHECK_EQ(msg_size(&msg),sizes[i]);
+    for(int j=0;j<sizes[i];++j)
+      msg_data(&msg)[j]=(int8_t)(j+i);
+    msg_init(&copy);
+    msg_copy(&msg,&copy);
+    msg_free(&msg);
+    bool ok=msg_size(&copy)==sizes[i];
+    for(int j=0;ok&&j<sizes[i];++j)
+      ok=msg_data(&copy)[j]==(int8_t)(j+i);
+    CHECK(ok);
+    msg_free(&copy);
+  }
+}
+
+static const int ezMsgBytes=1000;
+static const int ezInFlight=512;
+
+// allocates msgs and posts them to the consumer,never more than ezInFlight outstanding
+class MsgProducer:public base::Threads
+{
+public:
+  MsgProducer(base::NotifyQueue<Msg>* q,int n,std::atomic<int>* inflight):q_(q),n_(n),inflight_(inflight){}
+  virtual void run()
+  {
+    for(int i=0;i<n_;++i)
+    {
+      while(inflight_->load()>=ezInFlight)
+        base::sleep(0);
+      Msg msg;
+      msg_init_size(&msg,ezMsgBytes);
+      memset(msg_data(&msg),(int8_t)i,ezMsgBytes);
+      inflight_->fetch_add(1);
+      q_->send(msg);
+    }
+  }
+private:
+  base::NotifyQueue<Msg>* q_;
+  int n_;
+  std::atomic<int>* inflight_;
+};
+
+// frees on its own thread what the producer allocated,checking no block was handed out twice
+class MsgConsumer:public base::Threads
+{
+public:
+  MsgConsumer(base::NotifyQueue<Msg>* q,int n,std::atomic<int>* inflight):q_(q),n_(n),inflight_(inflight),bad_(0),done_(0){}
+  virtual void run()
+  {
+    for(int i=0;i<n_;)
+    {
+      Msg msg;
+      if(!q_->recv(msg))
+      {
+        base::sleep(0);
+        continue;
+      }
+      int8_t* d=msg_data(&msg);
+      for(int j=0;j<ezMsgBytes;++j)
+      {
+        if(d[j]!=(int8_t)i)
+        {
+          ++bad_;
+          break;
+        }
+      }
+      msg_free(&msg);
+      inflight_->fetch_sub(1);
+      done_.store(++i);
+    }
+  }
+  int bad() {return bad_;}
+  int done() {return done_.load();}
+private:
+  base::NotifyQueue<Msg>* q_;
+  int n_;
+  std::atomic<int>* inflight_;
+  int bad_;
+  std::atomic<int> done_;
+};
+
+// blocks freed on the consumer thread go back to the producer a batch at a time:
+// the pool stays at what is in flight however many msgs pass,the counts balance.
+// the peak is sampled while both run,exiting threads hand back what they cached
+static void test_cross_thread()
+{
+  const int n=200000;
+  MsgPoolStats before=class_stats(ezMsgBytes+64);
+  base::NotifyQueue<Msg> q;
+  std::atomic<int> inflight(0);
+  MsgProducer producer(&q,n,&inflight);
+  MsgConsumer consumer(&q,n,&inflight);
+  consumer.start();
+  producer.start();
+  int64_t peak=0;
+  while(consumer.done()<n)
+  {
+    int64_t sys=class_stats(ezMsgBytes+64).sysblocks_-before.sysblocks_;
+    if(sys>peak)
+      peak=sys;
+    base::sleep(1);
+  }
+  producer.join();
+  consumer.join();
+  CHECK_EQ(consumer.bad(),0);
+  MsgPoolStats after=class_stats(ezMsgBytes+64);
+  CHECK_EQ(after.allocs_-before.allocs_,n);
+  CHECK_EQ(after.frees_-before.frees_,n);
+  CHECK(peak<ezInFlight*4);
+  // what the exited threads cached went to the central list or back to malloc
+  CHECK(after.central_<=after.sysblocks_);
+}
+
+// a thread_local built before the thread's first msg,so destroyed after its pool cache
+struct LateHolder
+{
+  LateHolder() {msg_init(&msg_);}
+  ~LateHolder() {msg_free(&msg_);}
+  Msg msg_;
+};
+
+static thread_local LateHolder t_late;
+
+class LateFreer:public base::Threads
+{
+public:
+  virtual void run()
+  {
+    msg_free(&t_late.msg_);
+    msg_init_size(&t_late.msg_,ezMsgBytes);
+    Msg msg;
+    msg_init_size(&msg,ezMsgBytes);
+    msg_free(&msg);
+  }
+};
+
+// a msg freed after the thread cache is gone still balances the counts,
+// it doesn't land on the destroyed cache
+static void test_free_after_cache()
+{
+  MsgPoolStats before=class_stats(ezMsgBytes+64);
+  LateFreer freer;
+  freer.start();
+  freer.join();
+  MsgPoolStats after=class_stats(ezMsgBytes+64);
+  CHECK_EQ(after.allocs_-before.allocs_,2);
+  CHECK_EQ(after.frees_-before.frees_,2);
+  CHECK(after.central_<=after.sysblocks_);
+}
+
+// central batches left idle over a whole trim interval go back to malloc,
+// the first trim only marks what is there
+static void test_trim()
+{
+  MsgPoolStats before=class_stats(ezMsgBytes+64);
+  msg_pool_trim();
+  base::sleep(1100);
+  msg_pool_trim();
+  MsgPoolStats after=class_stats(ezMsgBytes+64);
+  CHECK_EQ(after.central_,0);
+  CHECK_EQ(after.sysblocks_,before.sysblocks_-before.central_);
+}
+
+int main(int argc,char** argv)
+{
+  test_classes();
+  test_msgs();
+  test_cross_thread();
+  test_free_after_cache();
+  test_trim();
+  return check_result("msgpool_test");
+}
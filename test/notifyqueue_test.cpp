@@ -0,0 +1,196 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../base/notifyqueue.h"
+#include "check.h"
+
+#include <poll.h>
+#include <atomic>
+#include <vector>
+
+struct Item
+{
+  int     producer_;
+  int64_t seq_;
+};
+
+typedef base::NotifyQueue<Item> ItemQueue;
+
+// sends n items,then stays alive until released so its lane isn't handed on
+class Producer:public base::Threads
+{
+public:
+  Producer(ItemQueue* q,int id,int64_t n,std::atomic<int>* sent,std::atomic<bool>* release)
+    :q_(q),id_(id),n_(n),sent_(sent),release_(release),laneid_(-1){}
+  virtual void run()
+  {
+    laneid_=base::notify_producer_id();
+    for(int64_t i=0;i<n_;++i)
+    {
+      Item item={id_,i};
+      q_->send(item);
+    }
+    sent_->fetch_add(1);
+    while(release_&&!release_->load())
+      base::sleep(1);
+  }
+  int laneid() {return laneid_;}
+private:
+  ItemQueue* q_;
+  int        id_;
+  int64_t    n_;
+  std::atomic<int>*  sent_;
+  std::atomic<bool>* release_;
+  int        laneid_;
+};
+
+static void wait_sent(std::atomic<int>& sent,int n)
+{
+  while(sent.load()<n)
+    base::sleep(1);
+}
+
+// while two lanes both hold items recv alternates between them,whichever lane
+// the busy producer got
+static void test_lane_fairness()
+{
+  for(int busyfirst=0;busyfirst<2;++busyfirst)
+  {
+    ItemQueue q;
+    std::atomic<int> sent(0);
+    std::atomic<bool> release(false);
+    Producer busy(&q,0,1000,&sent,&release);
+    Producer quiet(&q,1,3,&sent,&release);
+    Producer* order[2]={busyfirst?&busy:&quiet,busyfirst?&quiet:&busy};
+    order[0]->start();
+    wait_sent(sent,1);
+    order[1]->start();
+    wait_sent(sent,2);
+    CHECK(busy.laneid()!=quiet.laneid());
+    Item item;
+    int quietgot=0;
+    for(int i=0;i<6;++i)
+    {
+      CHECK(q.recv(item));
+      if(item.producer_==1)
+        ++quietgot;
+    }
+    CHECK_EQ(quietgot,3);
+    int total=6;
+    while(q.recv(item))
+      ++total;
+    CHECK_EQ(total,1003);
+    release=true;
+    busy.join();
+    quiet.join();
+  }
+}
+
+// an exiting thread gives its lane id back,so threads coming and going never run
+// past the lanes into the locked overflow
+static void test_id_reuse()
+{
+  ItemQueue q;
+  std::atomic<int> sent(0);
+  int maxid=0;
+  for(int i=0;i<ItemQueue::MAX_LANES*2;++i)
+  {
+    Producer p(&q,i,1,&sent,nullptr);
+    p.start();
+    p.join();
+    if(p.laneid()>maxid)
+      maxid=p.laneid();
+  }
+  CHECK(maxid<4);
+  Item item;
+  int got=0;
+  while(q.recv(item))
+    ++got;
+  CHECK_EQ(got,ItemQueue::MAX_LANES*2);
+}
+
+// more live producers than lanes,the rest go through the overflow lane
+static void test_overflow()
+{
+  const int n=ItemQueue::MAX_LANES+8;
+  ItemQueue q;
+  std::atomic<int> sent(0);
+  std::atomic<bool> release(false);
+  std::vector<Producer*> producers;
+  for(int i=0;i<n;++i)
+  {
+    producers.push_back(new Producer(&q,i,10,&sent,&release));
+    producers.back()->start();
+  }
+  wait_sent(sent,n);
+  std::vector<int64_t> next(n,0);
+  Item item;
+  int got=0;
+  while(q.recv(item))
+  {
+    CHECK_EQ(item.seq_,next[item.producer_]);
+    next[item.producer_]=item.seq_+1;
+    ++got;
+  }
+  CHECK_EQ(got,n*10);
+  release=true;
+  for(int i=0;i<n;++i)
+  {
+    producers[i]->join();
+    delete producers[i];
+  }
+}
+
+// the consumer sleeps on the signaler whenever it runs dry,a lost wakeup shows
+// up as a poll timing out with items still to come.per producer order holds
+static void test_wakeup()
+{
+  const int np=4;
+  const int64_t each=200000;
+  ItemQueue q;
+  std::atomic<int> sent(0);
+  std::vector<Producer*> producers;
+  for(int i=0;i<np;++i)
+  {
+    producers.push_back(new Producer(&q,i,each,&sent,nullptr));
+    producers.back()->start();
+  }
+  std::vector<int64_t> next(np,0);
+  int64_t got=0;
+  int timeouts=0;
+  Item item;
+  while(got<np*each&&timeouts==0)
+  {
+    if(q.recv(item))
+    {
+      CHECK_EQ(item.seq_,next[item.producer_]);
+      next[item.producer_]=item.seq_+1;
+      ++got;
+      continue;
+    }
+    if(!q.prepare_wait())
+      continue;
+    struct pollfd pfd={q.get_fd(),POLLIN,0};
+    if(::poll(&pfd,1,3000)>0)
+      q.consume_signal();
+    else
+      ++timeouts;
+    q.finish_wait();
+  }
+  CHECK_EQ(timeouts,0);
+  CHECK_EQ(got,np*each);
+  for(int i=0;i<np;++i)
+  {
+    producers[i]->join();
+    delete producers[i];
+  }
+}
+
+int main(int argc,char** argv)
+{
+  test_lane_fairness();
+  test_id_reuse();
+  test_overflow();
+  test_wakeup();
+  return check_result("notifyqueue_test");
+}
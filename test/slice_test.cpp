@@ -0,0 +1,188 @@
+#include "../base/portable.h"
+#include "../base/thread.h"
+#include "../net/socket.h"
+#include "../net/netpack.h"
+#include "../net/buffer.h"
+#include "../net/net_interface.h"
+#include "../net/fd.h"
+#include "check.h"
+
+#include <string.h>
+#include <vector>
+
+using namespace net;
+
+static void fill(std::vector<char>& data,int seed)
+{
+  for(size_t i=0;i<data.size();++i)
+    data[i]=(char)(i*13+seed);
+}
+
+// a slice keeps its block out of the pool,through drain and every copy of the msg
+static void test_slice_holds_block()
+{
+  BufferPool pool(4096);
+  Buffer buf(&pool,1<<20);
+  std::vector<char> data(3000);
+  fill(data,1);
+  buf.add(&data[0],data.size());
+  char* p=nullptr;
+  buf.readable(p);
+  Msg msg,copy;
+  msg_init(&copy);
+  buf.slice(&msg,p+100,1000);
+  CHECK(msg_data(&msg)==(int8_t*)p+100);
+  msg_copy(&msg,&copy);
+  buf.drain(data.size());
+  CHECK_EQ(buf.off(),0);
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),1);
+  CHECK(memcmp(msg_data(&msg),&data[100],1000)==0);
+  msg_free(&msg);
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),1);
+  CHECK(memcmp(msg_data(&copy),&data[100],1000)==0);
+  msg_free(&copy);
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),0);
+  CHECK_EQ(pool.free_blocks(),1);
+}
+
+class FreeThread:public base::Threads
+{
+public:
+  explicit FreeThread(std::vector<Msg>* msgs):msgs_(msgs){}
+  virtual void run()
+  {
+    for(size_t i=0;i<msgs_->size();++i)
+      msg_free(&(*msgs_)[i]);
+  }
+private:
+  std::vector<Msg>* msgs_;
+};
+
+// the last slice freed on another thread hands the block back through the pool's
+// remote list,the owner thread recycles it
+static void test_slice_remote_free()
+{
+  BufferPool pool(4096);
+  Buffer buf(&pool,1<<20);
+  std::vector<Msg> msgs(100);
+  std::vector<char> data(4096*10);
+  fill(data,2);
+  for(int b=0;b<10;++b)
+  {
+    buf.add(&data[b*4096],4096);
+    char* p=nullptr;
+    buf.readable(p);
+    for(int i=0;i<10;++i)
+      buf.slice(&msgs[b*10+i],p+i*400,400);
+    buf.drain(4096);
+  }
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),10);
+  FreeThread t(&msgs);
+  t.start();
+  t.join();
+  CHECK_EQ(pool.used_blocks(),10);
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),0);
+  CHECK_EQ(pool.free_blocks(),10);
+}
+
+// pulling up a frame behind a live slice copies it out,the sliced bytes stay put
+static void test_pullup_keeps_slice()
+{
+  BufferPool pool(1024);
+  Buffer buf(&pool,1<<20);
+  std::vector<char> data(2048);
+  fill(data,3);
+  buf.add(&data[0],data.size());
+  char* p=nullptr;
+  buf.readable(p);
+  Msg msg;
+  buf.slice(&msg,p,900);
+  buf.drain(1000);
+  // 24 bytes left in the first block,the next frame straddles into the second
+  CHECK(buf.pullup(200)>=200);
+  buf.readable(p);
+  CHECK(memcmp(p,&data[1000],200)==0);
+  CHECK(memcmp(msg_data(&msg),&data[0],900)==0);
+  msg_free(&msg);
+  buf.drain(buf.off());
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),0);
+}
+
+class CollectPusher:public IMessagePusher
+{
+public:
+  virtual bool push_msg(Msg* msg)
+  {
+    msgs_.push_back(Msg());
+    msg_init(&msgs_.back());
+    msg_move(msg,&msgs_.back());
+    return true;
+  }
+  std::vector<Msg> msgs_;
+};
+
+static void add_frame(std::vector<char>& stream,const std::vector<char>& payload)
+{
+  uint16_t len=(uint16_t)payload.size();
+  const char* l=(const char*)&len;
+  stream.insert(stream.end(),l,l+sizeof(len));
+  stream.insert(stream.end(),payload.begin(),payload.end());
+}
+
+// MsgDecoder copies short payloads and slices those of slicesize and up out of the
+// receive block,no copy and no allocation
+static void test_decoder_slices()
+{
+  BufferPool pool(4096);
+  Buffer buf(&pool,1<<20);
+  MsgDecoder decoder(60000,200);
+  std::vector<char> small(100),large(500),stream;
+  fill(small,4);
+  fill(large,5);
+  add_frame(stream,small);
+  add_frame(stream,large);
+  add_frame(stream,large);
+  buf.add(&stream[0],stream.size());
+  char* p=nullptr;
+  int rs=buf.readable(p);
+  CollectPusher pusher;
+  int used=decoder.decode_buffer(&pusher,&buf,p,rs);
+  CHECK_EQ(used,(int)stream.size());
+  CHECK_EQ(pusher.msgs_.size(),3);
+  if(pusher.msgs_.size()==3)
+  {
+    Msg* m=&pusher.msgs_[0];
+    CHECK_EQ(msg_size(m),100);
+    CHECK(memcmp(msg_data(m),&small[0],100)==0);
+    CHECK((char*)msg_data(m)<p||(char*)msg_data(m)>=p+rs);
+    for(int i=1;i<3;++i)
+    {
+      m=&pusher.msgs_[i];
+      CHECK_EQ(msg_size(m),500);
+      CHECK(memcmp(msg_data(m),&large[0],500)==0);
+      CHECK((char*)msg_data(m)>=p&&(char*)msg_data(m)+500<=p+rs);
+    }
+  }
+  buf.drain(used);
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),1);
+  for(size_t i=0;i<pusher.msgs_.size();++i)
+    msg_free(&pusher.msgs_[i]);
+  pool.collect_remote();
+  CHECK_EQ(pool.used_blocks(),0);
+}
+
+int main(int argc,char** argv)
+{
+  test_slice_holds_block();
+  test_slice_remote_free();
+  test_pullup_keeps_slice();
+  test_decoder_slices();
+  return check_result("slice_test");
+}
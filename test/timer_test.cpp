@@ -0,0 +1,161 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../net/poller.h"
+#include "check.h"
+
+#include <vector>
+
+using namespace net;
+
+static int64_t g_now=0;
+
+class TestHander:public IPollerEventHander
+{
+public:
+  TestHander():fired_(0),firedat_(-1),rearm_(0),timer_(nullptr){}
+  virtual void handle_in_event(){}
+  virtual void handle_out_event(){}
+  virtual void handle_timer()
+  {
+    ++fired_;
+    firedat_=g_now;
+    if(rearm_>0)
+      timer_->add_timer(this,rearm_);
+  }
+  int     fired_;
+  int64_t firedat_;
+  int64_t rearm_;
+  PollTimer* timer_;
+};
+
+// walk the clock 1ms per call up to end,as the poller does
+static void advance(PollTimer& timer,int64_t end)
+{
+  for(;g_now<end;)
+  {
+    ++g_now;
+    timer.invoke_timer(g_now);
+  }
+}
+
+// every level of the wheel,a timer fires on the first tick at or past its deadline
+static void test_expire()
+{
+  const int64_t timeouts[]={0,1,2,255,256,257,1000,16383,16384,16385,100000,1048577};
+  const int n=sizeof(timeouts)/sizeof(timeouts[0]);
+  PollTimer timer;
+  std::vector<TestHander> handers(n);
+  int64_t t0=base::now_tick();
+  for(int i=0;i<n;++i)
+    timer.add_timer(&handers[i],timeouts[i]);
+  int64_t t1=base::now_tick();
+  CHECK_EQ(timer.size(),n);
+  g_now=t0-1;
+  advance(timer,t1+timeouts[n-1]+1);
+  for(int i=0;i<n;++i)
+  {
+    CHECK_EQ(handers[i].fired_,1);
+    CHECK(handers[i].firedat_>=t0+timeouts[i]);
+    CHECK(handers[i].firedat_<=t1+timeouts[i]);
+  }
+  CHECK_EQ(timer.size(),0);
+  CHECK_EQ(timer.invoke_timer(g_now+1),-1);
+}
+
+// a cancelled timer never fires and leaves nothing behind
+static void test_cancel()
+{
+  PollTimer timer;
+  std::vector<TestHander> handers(1000);
+  int64_t t0=base::now_tick();
+  for(size_t i=0;i<handers.size();++i)
+    timer.add_timer(&handers[i],1+(int64_t)i*37);
+  for(size_t i=0;i<handers.size();i+=2)
+    timer.del_timer(&handers[i]);
+  timer.del_timer(&handers[0]);
+  CHECK_EQ(timer.size(),handers.size()/2);
+  g_now=t0-1;
+  advance(timer,t0+37*1000+10);
+  for(size_t i=0;i<handers.size();++i)
+    CHECK_EQ(handers[i].fired_,i%2?1:0);
+  CHECK_EQ(timer.size(),0);
+}
+
+// add_timer on an armed hander moves it instead of adding a second entry
+static void test_reschedule()
+{
+  PollTimer timer;
+  TestHander hander;
+  int64_t t0=base::now_tick();
+  timer.add_timer(&hander,100);
+  timer.add_timer(&hander,5000);
+  int64_t t1=base::now_tick();
+  CHECK_EQ(timer.size(),1);
+  g_now=t0-1;
+  advance(timer,t0+4999);
+  CHECK_EQ(hander.fired_,0);
+  advance(timer,t1+5001);
+  CHECK_EQ(hander.fired_,1);
+  CHECK(hander.firedat_>=t0+5000);
+}
+
+// a hander re-arming itself from handle_timer keeps its period.add_timer reads the
+// real clock,so this one runs in real time
+static void test_rearm()
+{
+  PollTimer timer;
+  TestHander hander;
+  hander.timer_=&timer;
+  hander.rearm_=20;
+  int64_t t0=base::now_tick();
+  timer.add_timer(&hander,20);
+  while(base::now_tick()<t0+205)
+  {
+    g_now=base::now_tick();
+    timer.invoke_timer(g_now);
+    base::sleep(1);
+  }
+  // sleeps overshoot,each period can only stretch
+  CHECK(hander.fired_>=5&&hander.fired_<=10);
+  CHECK_EQ(timer.size(),1);
+  timer.del_timer(&hander);
+  CHECK_EQ(timer.size(),0);
+}
+
+// the wait the poller gets back never overshoots the next deadline
+static void test_next_timeout()
+{
+  PollTimer timer;
+  TestHander near,far;
+  int64_t t0=base::now_tick();
+  timer.add_timer(&near,40);
+  timer.add_timer(&far,3000);
+  int64_t wait=timer.invoke_timer(t0);
+  CHECK(wait>=0&&wait<=40);
+  timer.del_timer(&near);
+  wait=timer.invoke_timer(t0+1);
+  CHECK(wait>0&&wait<=3000);
+}
+
+// a hander deleted while armed unlinks itself
+static void test_destroy_armed()
+{
+  PollTimer timer;
+  TestHander* hander=new TestHander;
+  timer.add_timer(hander,10);
+  delete hander;
+  CHECK_EQ(timer.size(),0);
+  timer.invoke_timer(base::now_tick()+100);
+}
+
+int main(int argc,char** argv)
+{
+  test_expire();
+  test_cancel();
+  test_reschedule();
+  test_rearm();
+  test_next_timeout();
+  test_destroy_armed();
+  return check_result("timer_test");
+}
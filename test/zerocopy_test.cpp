@@ -0,0 +1,247 @@
+#include "../base/portable.h"
+#include "../base/eztime.h"
+#include "../base/thread.h"
+#include "../net/socket.h"
+#include "../net/netpack.h"
+#include "../net/net_interface.h"
+#include "check.h"
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+using namespace net;
+
+static const int ezPayloads=16;
+static const int ezPayloadSize=50000;
+
+static std::atomic<int> g_freed(0);
+
+// once set,the first MSG_ZEROCOPY send only takes a few bytes and the others fail with
+// ENOBUFS,as if optmem ran out,so the rest goes out copied.they would block for the
+// first 100ms,the completion of the first one comes in meanwhile
+static std::atomic<bool> g_enobufs(false);
+static std::atomic<int> g_zcsends(0);
+static std::atomic<int64_t> g_zcfirst(0);
+
+extern "C" ssize_t sendmsg(int fd,const struct msghdr* msg,int flags)
+{
+  if(!(flags&MSG_ZEROCOPY)||!g_enobufs.load())
+    return syscall(SYS_sendmsg,fd,msg,flags);
+  if(g_zcsends.fetch_add(1)>0)
+  {
+    errno=base::now_tick()-g_zcfirst.load()<100?EAGAIN:ENOBUFS;
+    return -1;
+  }
+  g_zcfirst=base::now_tick();
+  struct msghdr head=*msg;
+  struct iovec iov=msg->msg_iov[0];
+  if(iov.iov_len>1000)
+    iov.iov_len=1000;
+  head.msg_iov=&iov;
+  head.msg_iovlen=1;
+  return syscall(SYS_sendmsg,fd,&head,flags);
+}
+
+// a payload is scribbled over as it's freed,what tcp sends out of it afterwards
+// reaches the peer wrong
+static void scribble_free(void* data,void* hint)
+{
+  memset(data,0xdd,(size_t)hint);
+  free(data);
+  g_freed.fetch_add(1);
+}
+
+class CloseHander:public IConnnectionHander
+{
+public:
+  CloseHander():conn_(nullptr),closed_(0){}
+  virtual void on_open(Connection* conn) {conn_=conn;}
+  virtual void on_close(Connection* conn) {++closed_;}
+  virtual void on_data(Connection* conn,Msg* msg){}
+  Connection* conn_;
+  int closed_;
+};
+
+static EventLoop* g_loop=nullptr;
+
+static void pump(int ms)
+{
+  int64_t end=base::now_tick()+ms;
+  while(base::now_tick()<end)
+    event_process(g_loop,5);
+}
+
+static char payload_byte(int k,int i)
+{
+  return (char)(k*31+i*7+1);
+}
+
+static void expected_stream(std::vector<char>& stream)
+{
+  for(int k=0;k<ezPayloads;++k)
+  {
+    uint16_t len=ezPayloadSize;
+    const char* l=(const char*)&len;
+    stream.insert(stream.end(),l,l+sizeof(len));
+    for(int i=0;i<ezPayloadSize;++i)
+      stream.push_back(payload_byte(k,i));
+  }
+}
+
+static SOCKET connect_slow_reader(int port,CloseHander& hander)
+{
+  SOCKET s=socket(AF_INET,SOCK_STREAM,0);
+  int rcvbuf=4096;
+  setsockopt(s,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+  struct sockaddr_in addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_port=htons(port);
+  addr.sin_addr.s_addr=inet_addr("127.0.0.1");
+  CHECK_EQ(::connect(s,(struct sockaddr*)&addr,sizeof(addr)),0);
+  int64_t end=base::now_tick()+3000;
+  while(!hander.conn_&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK(hander.conn_!=nullptr);
+  return s;
+}
+
+static void send_payloads(Connection* conn)
+{
+  for(int k=0;k<ezPayloads;++k)
+  {
+    char* p=(char*)malloc(ezPayloadSize);
+    for(int i=0;i<ezPayloadSize;++i)
+      p[i]=payload_byte(k,i);
+    Msg msg;
+    msg_init_data(&msg,(int8_t*)p,ezPayloadSize,&scribble_free,(void*)(size_t)ezPayloadSize);
+    msg_send(conn,&msg);
+  }
+  event_flush(g_loop);
+}
+
+// a peer that reads nothing leaves most of a burst of referenced payloads to go out
+// from their own pages after the connection is closed.they are only freed once the
+// kernel reports it is done with them:every byte the peer reads afterwards is intact,
+// and no payload is kept past that
+static void test_close_with_sends_in_flight(int port)
+{
+  MsgDecoder decoder(60000);
+  MsgEncoder encoder(1024);
+  CloseHander hander;
+  g_loop=create_event_loop(&hander,&decoder,&encoder,1);
+  // room for the whole burst,the close isn't held up behind it
+  set_msg_buffer_size(g_loop,4<<20);
+  set_zerocopy(g_loop,1024);
+  CHECK_EQ(serve_on_port(g_loop,port),0);
+  g_freed=0;
+  SOCKET s=connect_slow_reader(port,hander);
+  if(!hander.conn_)
+    return;
+
+  send_payloads(hander.conn_);
+  pump(200);
+  CHECK(g_freed.load()<ezPayloads);
+  close_connection(hander.conn_);
+  int64_t end=base::now_tick()+3000;
+  while(hander.closed_<1&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK_EQ(hander.closed_,1);
+  pump(100);
+
+  std::vector<char> in;
+  std::vector<char> chunk(64*1024);
+  end=base::now_tick()+5000;
+  while(base::now_tick()<end)
+  {
+    int n=(int)recv(s,&chunk[0],chunk.size(),MSG_DONTWAIT);
+    if(n==0)
+      break;
+    if(n>0)
+      in.insert(in.end(),chunk.begin(),chunk.begin()+n);
+    else
+      event_process(g_loop,5);
+  }
+  close(s);
+  std::vector<char> stream;
+  expected_stream(stream);
+  // what the server had written to the socket by the close,the rest was dropped
+  CHECK(in.size()>4096u*4);
+  CHECK(in.size()<=stream.size());
+  CHECK(!in.empty()&&memcmp(&in[0],&stream[0],in.size())==0);
+  end=base::now_tick()+3000;
+  while(g_freed.load()<ezPayloads&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK_EQ(g_freed.load(),ezPayloads);
+  destroy_event_loop(g_loop);
+  g_loop=nullptr;
+}
+
+// the first payload starts out with MSG_ZEROCOPY and is finished copied after ENOBUFS.
+// its completion comes while the rest is still queued behind the slow peer,the block
+// must not wait for it again once drained:every payload is freed while the
+// connection is still open
+static void test_copy_fallback(int port)
+{
+  MsgDecoder decoder(60000);
+  MsgEncoder encoder(1024);
+  CloseHander hander;
+  g_loop=create_event_loop(&hander,&decoder,&encoder,1);
+  set_msg_buffer_size(g_loop,4<<20);
+  set_zerocopy(g_loop,1024);
+  CHECK_EQ(serve_on_port(g_loop,port),0);
+  g_freed=0;
+  SOCKET s=connect_slow_reader(port,hander);
+  if(!hander.conn_)
+    return;
+
+  g_enobufs=true;
+  send_payloads(hander.conn_);
+  pump(200);
+  std::vector<char> stream;
+  expected_stream(stream);
+  std::vector<char> in;
+  std::vector<char> chunk(64*1024);
+  int64_t end=base::now_tick()+5000;
+  while(in.size()<stream.size()&&base::now_tick()<end)
+  {
+    int n=(int)recv(s,&chunk[0],chunk.size(),MSG_DONTWAIT);
+    if(n>0)
+      in.insert(in.end(),chunk.begin(),chunk.begin()+n);
+    else
+      event_process(g_loop,5);
+  }
+  CHECK_EQ(in.size(),stream.size());
+  CHECK(in.size()==stream.size()&&memcmp(&in[0],&stream[0],in.size())==0);
+  CHECK(g_zcsends.load()>1);
+  end=base::now_tick()+3000;
+  while(g_freed.load()<ezPayloads&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK_EQ(g_freed.load(),ezPayloads);
+  g_enobufs=false;
+  close_connection(hander.conn_);
+  end=base::now_tick()+3000;
+  while(hander.closed_<1&&base::now_tick()<end)
+    event_process(g_loop,5);
+  CHECK_EQ(hander.closed_,1);
+  close(s);
+  destroy_event_loop(g_loop);
+  g_loop=nullptr;
+}
+
+int main(int argc,char** argv)
+{
+  net_initialize();
+  int port=20000+getpid()%20000;
+  test_close_with_sends_in_flight(port);
+  test_copy_fallback(port+1);
+  return check_result("zerocopy_test");
+}